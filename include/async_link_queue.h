@@ -0,0 +1,100 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef LOOMLIB_ASYNC_LINK_QUEUE_H
+#define LOOMLIB_ASYNC_LINK_QUEUE_H
+
+/*
+ * A FIFO queue of caller-owned items built on LINK_QUEUE.
+ * Locking is provided. Like LINK_QUEUE, items are queued by their embedded
+ * struct loomlib_link so pushing and popping never allocate.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "link_queue.h"
+
+
+struct async_link_queue;
+
+/*
+ * Create an empty queue.
+ * Returns NULL on failure (out of memory).
+ */
+struct async_link_queue *
+async_link_queue_new (void);
+
+/*
+ * Create an empty queue which holds at most CAPACITY items.
+ * A CAPACITY of zero gives an unbounded queue (same as
+ * ASYNC_LINK_QUEUE_NEW). Returns NULL on failure (out of memory).
+ */
+struct async_link_queue *
+async_link_queue_new_bounded (size_t capacity);
+
+/*
+ * Free a queue.
+ * This will block until the queue is empty.
+ */
+void
+async_link_queue_free (struct async_link_queue *queue);
+
+/*
+ * Enqueue an item by its embedded LINK.
+ * LINK may not be NULL. If the queue is bounded and full then the calling
+ * thread will block until another thread pops an item.
+ */
+void
+async_link_queue_push (struct async_link_queue *queue,
+                       struct loomlib_link *link);
+
+/*
+ * Enqueue an item without blocking.
+ * Returns false if the queue is full.
+ */
+bool
+async_link_queue_try_push (struct async_link_queue *queue,
+                           struct loomlib_link *link);
+
+/*
+ * Enqueue an item even if the queue is bounded and full. Never blocks.
+ */
+void
+async_link_queue_force_push (struct async_link_queue *queue,
+                             struct loomlib_link *link);
+
+/*
+ * Dequeue an item.
+ * If WAIT is false then popping an empty queue returns NULL, otherwise the
+ * calling thread will block until an item is pushed.
+ */
+struct loomlib_link *
+async_link_queue_pop (struct async_link_queue *queue, const bool wait);
+
+/*
+ * Count the number of items in a queue.
+ */
+size_t
+async_link_queue_count (struct async_link_queue *queue);
+
+#endif
@@ -30,6 +30,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <time.h>
 
 
 struct async_queue;
@@ -40,6 +41,13 @@ struct async_queue;
 struct async_queue *
 async_queue_new(void);
 
+/*
+ * Create an empty queue which holds at most CAPACITY items.
+ * A CAPACITY of zero gives an unbounded queue (same as async_queue_new).
+ */
+struct async_queue *
+async_queue_new_bounded(size_t capacity);
+
 /*
  * Free a queue.
  * A queue should not be popped/pushed/counted after freeing.
@@ -49,11 +57,34 @@ async_queue_free(struct async_queue *queue);
 
 /*
  * Enqueue an item.
- * The item passed may not be NULL.
+ * The item passed may not be NULL. If the queue is bounded and full then the
+ * calling thread will block until another thread pops an item.
  */
 bool
 async_queue_push(struct async_queue *queue, void *item);
 
+/*
+ * Enqueue an item without blocking.
+ * Returns false if the queue is full.
+ */
+bool
+async_queue_try_push(struct async_queue *queue, void *item);
+
+/*
+ * Enqueue an item, waiting no later than ABSTIME (measured against
+ * CLOCK_REALTIME) for room to become available.
+ * Returns false if the queue is still full when the deadline passes.
+ */
+bool
+async_queue_push_timeout(struct async_queue *queue, void *item,
+                         const struct timespec *abstime);
+
+/*
+ * Enqueue an item even if the queue is bounded and full. Never blocks.
+ */
+bool
+async_queue_force_push(struct async_queue *queue, void *item);
+
 /*
  * Dequeue an item.
  * If wait is false then popping an empty queue returns NULL, otherwise the
@@ -62,11 +93,36 @@ async_queue_push(struct async_queue *queue, void *item);
 void *
 async_queue_pop(struct async_queue *queue, const bool wait);
 
+/*
+ * Dequeue an item, blocking no later than ABSTIME (measured against
+ * CLOCK_REALTIME) for one to be pushed.
+ * Returns NULL if the queue is still empty when the deadline passes.
+ */
+void *
+async_queue_pop_timeout(struct async_queue *queue,
+                        const struct timespec *abstime);
+
+/*
+ * Get a file descriptor which polls readable while the queue holds items.
+ * The descriptor is created on the first call and is owned by the queue; it
+ * must not be read, written or closed by the caller. Once it polls readable,
+ * drain the queue with async_queue_pop(queue, false) until it gives NULL.
+ * Returns -1 if notification is not supported on this system.
+ */
+int
+async_queue_eventfd(struct async_queue *queue);
+
 /*
  * Count the number of items in a queue.
  */
 size_t
 async_queue_count(struct async_queue *queue);
 
+/*
+ * Maximum number of items the queue will hold, or zero if it is unbounded.
+ */
+size_t
+async_queue_capacity(struct async_queue *queue);
+
 #endif
 
@@ -0,0 +1,95 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef LOOMLIB_FILE_INLET_H
+#define LOOMLIB_FILE_INLET_H
+
+/*
+ * A pipeline inlet which streams a file in chunks.
+ * The file is memory mapped and each chunk just points into the mapping, so
+ * no chunk is copied or read into a buffer of its own. Chunks end just past
+ * a record delimiter, so no record is split between two chunks, and the
+ * pages ahead of the last chunk are prefetched. Use it as the inlet of a
+ * pipeline:
+ *
+ *   pipeline_add_inlet (pipe, file_inlet_next, inlet);
+ *
+ * and hand every chunk back with FILE_INLET_RELEASE once it is consumed
+ * (usually in the outlet) so its pages can be dropped from memory.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+struct file_inlet;
+
+/*
+ * SIZE bytes of the file starting at OFFSET, which DATA points to.
+ */
+struct file_chunk
+{
+  const char *data;
+  size_t size;
+  size_t offset;
+};
+
+/*
+ * Open and map the file at PATH.
+ * Chunks will be about CHUNK_SIZE bytes: each is extended up to and
+ * including the next DELIMITER byte, unless DELIMITER is negative. Returns
+ * NULL on failure.
+ */
+struct file_inlet *
+file_inlet_new (const char *path, size_t chunk_size, int delimiter);
+
+/*
+ * Unmap the file. Every chunk must have been released first.
+ */
+void
+file_inlet_free (struct file_inlet *inlet);
+
+/*
+ * Get the next chunk (a struct file_chunk *) of the file INLET, or NULL
+ * once the whole file has been handed out. This is an inlet routine for
+ * PIPELINE_ADD_INLET and must not be called concurrently.
+ * NULL is also returned if a chunk could not be allocated, which ends the
+ * stream early; check FILE_INLET_FAILED once the pipeline has dried up.
+ */
+void *
+file_inlet_next (void *inlet);
+
+/*
+ * Whether FILE_INLET_NEXT stopped short of the end of the file because it
+ * ran out of memory.
+ */
+bool
+file_inlet_failed (struct file_inlet *inlet);
+
+/*
+ * Release a chunk returned by FILE_INLET_NEXT. It may be called from any
+ * thread and in any order.
+ */
+void
+file_inlet_release (struct file_inlet *inlet, struct file_chunk *chunk);
+
+#endif
@@ -33,6 +33,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <time.h>
 
 
 struct gamma_queue;
@@ -68,6 +69,29 @@ gamma_queue_push (struct gamma_queue *queue, void *item);
 void *
 gamma_queue_pop (struct gamma_queue *queue, bool wait);
 
+/*
+ * Dequeue an item, blocking no later than ABSTIME (measured against
+ * CLOCK_REALTIME) for one to be pushed.
+ * Returns NULL if the queue is still empty when the deadline passes. Since
+ * ITEM may be NULL, a NULL return does not by itself mean a timeout.
+ */
+void *
+gamma_queue_pop_timeout (struct gamma_queue *queue,
+                         const struct timespec *abstime);
+
+/*
+ * Get a file descriptor which polls readable once the queue becomes
+ * non-empty.
+ * The descriptor is created on the first call and is owned by the queue; it
+ * must not be read, written or closed by the caller. Once it polls readable,
+ * drain the queue with gamma_queue_pop (queue, false). It may occasionally
+ * poll readable while the queue is empty, but it is never left unreadable
+ * while items are waiting. Returns -1 if notification is not supported on
+ * this system.
+ */
+int
+gamma_queue_eventfd (struct gamma_queue *queue);
+
 
 /*
  * NOTE:
@@ -0,0 +1,82 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#ifndef LOOMLIB_LINK_QUEUE_H
+#define LOOMLIB_LINK_QUEUE_H
+
+/*
+ * A FIFO queue of caller-owned items.
+ * Each item embeds a struct loomlib_link and is queued by linking that field,
+ * so pushing and popping never allocate. An item may only sit in one queue
+ * (per embedded link) at a time.
+ * No locking is provided.
+ */
+
+#include <stddef.h>
+
+
+struct loomlib_link
+{
+  struct loomlib_link *next;
+};
+
+struct link_queue
+{
+  struct loomlib_link *head;
+  struct loomlib_link **tail;
+  size_t count;
+};
+
+/*
+ * Get a pointer to the structure of type TYPE that embeds the link PTR as its
+ * field MEMBER.
+ */
+#define LOOMLIB_CONTAINER_OF(ptr, type, member) \
+  ((type *) ((char *) (ptr) - offsetof (type, member)))
+
+/*
+ * Initialize an empty queue.
+ */
+void
+link_queue_init (struct link_queue *queue);
+
+/*
+ * Enqueue an item by its embedded LINK.
+ * LINK may not be NULL.
+ */
+void
+link_queue_push (struct link_queue *queue, struct loomlib_link *link);
+
+/*
+ * Dequeue an item.
+ * Popping an empty queue gives NULL.
+ */
+struct loomlib_link *
+link_queue_pop (struct link_queue *queue);
+
+/*
+ * Count the number of items in a queue.
+ */
+size_t
+link_queue_count (const struct link_queue *queue);
+
+#endif
@@ -25,6 +25,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 
 /*
@@ -32,6 +33,59 @@
  */
 struct pipeline;
 
+struct cache;
+
+/*
+ * How a pump may be scheduled.
+ * PIPELINE_PARALLEL pumps may run on any number of products at once.
+ * PIPELINE_SERIAL_IN_ORDER pumps run on one product at a time, in the order
+ *   the products left the inlet.
+ * PIPELINE_SERIAL_OUT_OF_ORDER pumps run on one product at a time, in
+ *   whatever order they arrive.
+ * Serial pumps never run concurrently with themselves, so state kept in their
+ * DATA needs no locking.
+ */
+enum pipeline_mode
+{
+  PIPELINE_PARALLEL,
+  PIPELINE_SERIAL_IN_ORDER,
+  PIPELINE_SERIAL_OUT_OF_ORDER
+};
+
+/*
+ * Statistics for one stage of a pipeline, see PIPELINE_GET_STATS.
+ * Products are counted in batches (see PIPELINE_SET_BATCH), which are single
+ * products unless batching is enabled. For the inlet WAIT_NSEC is the time
+ * it spent parked at the in-flight limit, and IN_FLIGHT is the number of
+ * inlets (see PIPELINE_ADD_PARTITIONED_INLET) parked there right now.
+ */
+struct pipeline_stage_stats
+{
+  uint64_t runs;        /* batches the stage has run on */
+  uint64_t busy_nsec;   /* time spent running the stage */
+  uint64_t wait_nsec;   /* time products spent waiting to enter the stage */
+  size_t in_flight;     /* products waiting for or running in the stage */
+  size_t workers;       /* threads able to run the stage at once */
+};
+
+/*
+ * Statistics for a whole pipeline, see PIPELINE_GET_STATS.
+ * BOTTLENECK is the stage with the most busy time per worker: -1 for the
+ * inlet, the pump number for a pump, or the number of pumps for the outlet.
+ */
+struct pipeline_stats
+{
+  struct pipeline_stage_stats inlet;
+  size_t active_lines;  /* products between the inlet and the outlet */
+  size_t num_stages;    /* pumps, plus the outlet */
+  int bottleneck;
+};
+
+/*
+ * Where a fan-out pump sends the products it emits, see PIPELINE_EMIT.
+ */
+struct pipeline_emitter;
+
 /*
  * Create a new pipeline.
  * MAX_THREADS threads will be started.
@@ -42,7 +96,8 @@ pipeline_new (size_t max_threads);
 /*
  * Free a pipeline.
  * This will block until the pipe dries up (when the INLET routine returns NULL
- * and all of the PRODUCT has passed through the system).
+ * and all of the PRODUCT has passed through the system). A pipeline which was
+ * never executed, or whose setup PIPELINE_EXECUTE rejected, is freed at once.
  */
 void
 pipeline_free (struct pipeline *pipe);
@@ -54,6 +109,202 @@ pipeline_free (struct pipeline *pipe);
 bool
 pipeline_terminate (struct pipeline *pipe);
 
+/*
+ * Limit the number of products between the inlet and the outlet to
+ * MAX_INFLIGHT (which must be non-zero). The default is MAX_THREADS + 1.
+ * Once the limit is reached the inlet is not called again until a product
+ * leaves through the outlet; no thread spins waiting for that to happen.
+ * This may be changed while the pipeline is running.
+ */
+bool
+pipeline_set_max_inflight (struct pipeline *pipe, size_t max_inflight);
+
+/*
+ * When ORDERED is true, products reach the outlet in the order the inlet
+ * produced them and the outlet is never run concurrently. Products that
+ * finish early wait in a reorder buffer. They still count as in flight, so
+ * the buffer is bounded by the in-flight limit and a stalled product holds
+ * the inlet back instead of growing the buffer. Behind a fan-out pump the
+ * order can only be kept if the fan-out is PIPELINE_SERIAL_IN_ORDER, so
+ * PIPELINE_EXECUTE fails for an ordered outlet behind any other fan-out.
+ * Must be set before the pipeline is executed; returns false once it is.
+ */
+bool
+pipeline_set_ordered (struct pipeline *pipe, bool ordered);
+
+/*
+ * Tune the in-flight limit while the pipeline runs, and also the number of
+ * the pipe's threads which take work when TUNE_WORKERS is true. Every
+ * INTERVAL_USEC microseconds the outlet's throughput is measured and one of
+ * them is nudged up or down, hill-climbing toward peak throughput. While the
+ * mean time a product spends between the inlet and the outlet exceeds
+ * MAX_LATENCY_USEC (zero for no bound) they are only nudged down. Pumps
+ * with their own workers keep all of them.
+ * Must be set before the pipeline is executed; returns false once it is.
+ */
+bool
+pipeline_set_autotune (struct pipeline *pipe,
+                       unsigned long interval_usec,
+                       unsigned long max_latency_usec,
+                       bool tune_workers);
+
+/*
+ * Report the in-flight limit and the number of active threads currently in
+ * use, as chosen by the auto-tuner (or set by hand). Either pointer may be
+ * NULL.
+ */
+void
+pipeline_get_tuning (struct pipeline *pipe,
+                     size_t *max_inflight,
+                     size_t *active_workers);
+
+/*
+ * Hand every product back to CACHE once it has passed through the outlet,
+ * instead of leaving the outlet to free it. The inlet should then take its
+ * products from CACHE with CACHE_ALLOC, so that buffers go round the pipe
+ * rather than through the allocator. CACHE must hold products of one size
+ * and should have room for every product in flight (the in-flight limit
+ * times the batch size); it is not destroyed with the pipeline.
+ * Must be set before the pipeline is executed; returns false once it is.
+ */
+bool
+pipeline_set_product_cache (struct pipeline *pipe, struct cache *cache);
+
+/*
+ * Collect statistics on every stage when ENABLED is true (the default is
+ * false). This costs a couple of clock reads and atomic updates per stage
+ * for each batch.
+ * Must be set before the pipeline is executed; returns false once it is.
+ */
+bool
+pipeline_set_stats (struct pipeline *pipe, bool enabled);
+
+/*
+ * Take a snapshot of the statistics of a running (or finished) pipeline.
+ * STAGES receives the first MAX_STAGES stages, counting the pumps in order
+ * and then the outlet; STATS->NUM_STAGES tells how many there are, so the
+ * outlet is only included if MAX_STAGES is larger than the number of pumps.
+ * Returns false if statistics are not being collected.
+ */
+bool
+pipeline_get_stats (struct pipeline *pipe,
+                    struct pipeline_stats *stats,
+                    struct pipeline_stage_stats *stages,
+                    size_t max_stages);
+
+/*
+ * When FUSED is true a worker carries each product through consecutive
+ * stages itself instead of handing it back to the pool after every stage.
+ * A product only changes threads where a serial pump holds up products
+ * queued behind it, so short pumps are not dominated by scheduling and
+ * products stay hot in the cache. The inlet is still rescheduled through the
+ * pool so that idle workers start on new products.
+ * Must be set before the pipeline is executed; returns false once it is.
+ */
+bool
+pipeline_set_fused (struct pipeline *pipe, bool fused);
+
+/*
+ * Setup a pump which filters products, scheduled according to MODE.
+ * ROUTINE returns true to pass a product on and false to drop it, in which
+ * case the product is its own to free. A product which is dropped leaves the
+ * pipe (and frees its place in flight) at once, unless an in-order pump,
+ * fan-out or ordered outlet further on still has to account for it; then
+ * it skips straight to that stage. With batches a batch only leaves once all
+ * of its products are dropped. Pumps added with PIPELINE_ADD_BATCH_PUMP may
+ * drop products in the same way.
+ */
+bool
+pipeline_add_filter (struct pipeline *pipe,
+                     bool (*routine)(void *data, void *product),
+                     void *data,
+                     enum pipeline_mode mode);
+
+/*
+ * Setup a pump which turns each product into any number of new ones (say a
+ * chunk of a file into its records), scheduled according to MODE.
+ * ROUTINE sends each new product on with PIPELINE_EMIT, and the product it
+ * was handed is its own to free or reuse. The new products go through the
+ * rest of the pipe in the order they were emitted if MODE is
+ * PIPELINE_SERIAL_IN_ORDER; otherwise no in-order pump or ordered outlet may
+ * follow, as the inlet's order is lost. They count as in flight, and once
+ * they take the pipe over the in-flight limit the fan-out's thread takes
+ * them through the following stages itself, as far as it can, and then
+ * waits until the pipe is back under the limit (or everything the fan-out
+ * emitted has left it) before emitting more. It does not wait if every
+ * other worker of the pipe is already waiting in a fan-out.
+ */
+bool
+pipeline_add_fanout (struct pipeline *pipe,
+                     void (*routine)(void *data, void *product,
+                                     struct pipeline_emitter *emitter),
+                     void *data,
+                     enum pipeline_mode mode);
+
+/*
+ * Send PRODUCT from a fan-out routine on to the next stage. EMITTER is only
+ * valid during the call of the routine it was handed to. Returns false if
+ * there was no memory to send it with, in which case the product is still
+ * the routine's own.
+ */
+bool
+pipeline_emit (struct pipeline_emitter *emitter, void *product);
+
+/*
+ * Give pump number PUMP (counting from zero in the order the pumps were
+ * added) NUM_THREADS workers of its own which run nothing but that pump.
+ * Products are handed to the group through its own work queue rather than
+ * the shared one, so a costly pump cannot crowd out the others and its code
+ * and data stay resident on its workers' cores. If CPUS is not NULL it holds
+ * NUM_THREADS core numbers to pin the workers to (see THREAD_POOL_NEW_PINNED).
+ * Must be called after the pump is added and before the pipeline is executed.
+ */
+bool
+pipeline_set_pump_workers (struct pipeline *pipe, size_t pump,
+                           size_t num_threads, const int *cpus);
+
+/*
+ * Split the pipe into NUM_LANES lanes which share the pipe's threads. KEY
+ * hashes each product from the inlet (DATA is handed to it) and the product
+ * takes lane KEY % NUM_LANES. Serial pumps, and the ordered outlet, then only
+ * serialize and order products within a lane, so products with different
+ * keys no longer wait for each other while all products with the same key
+ * still pass in order. Each lane of a pump may keep state of its own, see
+ * PIPELINE_SET_LANE_DATA. Lanes cannot be combined with batches.
+ * Must be called before any pump is added. Returns false if it is not, or if
+ * batches are enabled.
+ */
+bool
+pipeline_set_lanes (struct pipeline *pipe,
+                    size_t num_lanes,
+                    size_t (*key)(void *data, void *product),
+                    void *data);
+
+/*
+ * Hand DATA, instead of the data the pump was added with, to pump number
+ * PUMP when it runs on a product in lane LANE. As a serial pump runs on one
+ * product per lane at a time, DATA needs no locking there.
+ * Must be called before the pipeline is executed.
+ */
+bool
+pipeline_set_lane_data (struct pipeline *pipe, size_t pump, size_t lane,
+                        void *data);
+
+/*
+ * Move products through the pipe in batches of up to BATCH_SIZE (default 1).
+ * The inlet is called until it has given BATCH_SIZE products, has dried up,
+ * or FLUSH_USEC microseconds have passed since the batch was started (zero
+ * means no timeout; the timeout is checked between inlet calls). A batch is
+ * admitted, ordered and scheduled as one unit, so the in-flight limit counts
+ * batches and scheduling costs are paid once per batch. Ordinary pumps and
+ * outlets are still called once per product. Returns false for batches of
+ * more than one product if the pipe has lanes (see PIPELINE_SET_LANES).
+ * Must be set before the pipeline is executed; returns false once it is.
+ */
+bool
+pipeline_set_batch (struct pipeline *pipe, size_t batch_size,
+                    unsigned long flush_usec);
+
 /*
  * Setup the beginning of the pipe, where the product is injected into the
  * system. ROUTINE should return a PRODUCT pointer that is passed to subsequent
@@ -65,6 +316,34 @@ pipeline_add_inlet (struct pipeline *pipe,
                     void *(*routine)(void *data),
                     void *data);
 
+/*
+ * Setup a batch inlet instead of an inlet.
+ * ROUTINE should store up to MAX (the batch size) products in PRODUCTS and
+ * return how many it stored. Returning zero means the inlet has dried up.
+ */
+bool
+pipeline_add_batch_inlet (struct pipeline *pipe,
+                          size_t (*routine)(void *data, void **products,
+                                            size_t max),
+                          void *data);
+
+/*
+ * Setup NUM_PARTITIONS concurrent inlets instead of an inlet, for sources
+ * which split into independent parts (files, shards, sockets).
+ * ROUTINE is called with every PARTITION from 0 to NUM_PARTITIONS - 1 and
+ * may run for several partitions at once, but never twice at once for the
+ * same one. It returns NULL once that partition has dried up; the pipe dries
+ * up once they all have. Products from every partition share the pumps, the
+ * outlet and the in-flight limit, and are numbered in the order they were
+ * produced for in-order pumps and the ordered outlet.
+ */
+bool
+pipeline_add_partitioned_inlet (struct pipeline *pipe,
+                                void *(*routine)(void *data,
+                                                 size_t partition),
+                                void *data,
+                                size_t num_partitions);
+
 /*
  * Setup the endpoint of the pipe, where the product leaves the pipe.
  * PRODUCT should be unallocated properly since it will no longer be
@@ -76,6 +355,38 @@ pipeline_add_outlet (struct pipeline *pipe,
                      void(*routine)(void *data, void *product),
                      void *data);
 
+/*
+ * Setup a batch outlet instead of an outlet.
+ * ROUTINE is handed every product of a batch at once.
+ */
+bool
+pipeline_add_batch_outlet (struct pipeline *pipe,
+                           void (*routine)(void *data, void **products,
+                                           size_t count),
+                           void *data);
+
+/*
+ * Run the pipeline on demand instead of as fast as the inlet allows. There
+ * is no outlet: products are taken from the end of the pipe by calling
+ * PIPELINE_NEXT, and the inlet is only run while fewer products are in
+ * flight or waiting to be taken than callers are waiting for, plus
+ * LOOKAHEAD. Memory use then follows demand rather than the inlet's speed.
+ * Use this instead of PIPELINE_ADD_OUTLET.
+ */
+bool
+pipeline_set_pull (struct pipeline *pipe, size_t lookahead);
+
+/*
+ * Take the next product from the end of a pulled pipeline which has been
+ * executed, blocking until one is ready. Products come in inlet order if
+ * the pipeline is ordered. Returns NULL once the pipe has dried up and every
+ * product has been taken. Any number of threads may pull at once.
+ * A pulled pipeline only dries up when it is pulled dry (or terminated), so
+ * pull until NULL before PIPELINE_FREE; products left behind are not freed.
+ */
+void *
+pipeline_next (struct pipeline *pipe);
+
 /*
  * Setup a pump to move the product through the pipe.
  * You may add as many pumps as necessary (including zero). Pumps will be
@@ -86,9 +397,35 @@ pipeline_add_pump (struct pipeline *pipe,
                    void *(*routine)(void *data, void *product),
                    void *data);
 
+/*
+ * Setup a pump which is scheduled according to MODE.
+ * PIPELINE_ADD_PUMP is the same as passing PIPELINE_PARALLEL.
+ */
+bool
+pipeline_add_pump_mode (struct pipeline *pipe,
+                        void *(*routine)(void *data, void *product),
+                        void *data,
+                        enum pipeline_mode mode);
+
+/*
+ * Setup a pump which is handed a whole batch at a time, so that it can
+ * vectorize over the batch or amortize per-call costs.
+ * ROUTINE may replace the COUNT products in PRODUCTS and returns how many to
+ * pass on (at most COUNT, kept at the front of the array); any products it
+ * drops are its own to free. It is scheduled according to MODE.
+ */
+bool
+pipeline_add_batch_pump (struct pipeline *pipe,
+                         size_t (*routine)(void *data, void **products,
+                                           size_t count),
+                         void *data,
+                         enum pipeline_mode mode);
+
 /*
  * Start running the pipeline.
- * This will return false if either an INLET or OUTLET has not been setup.
+ * This will return false if either an INLET or OUTLET has not been setup, or
+ * if an in-order pump or ordered outlet follows a fan-out which is not
+ * PIPELINE_SERIAL_IN_ORDER.
  */
 bool
 pipeline_execute (struct pipeline *pipe);
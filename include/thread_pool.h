@@ -26,12 +26,29 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#include "link_queue.h"
+
 
 /*
  * A thread pool.
  */
 struct thread_pool;
 
+/*
+ * A work unit owned by the caller.
+ * Embed this in your own structure and pass it to THREAD_POOL_PUSH_WORK to
+ * queue work without the pool allocating anything. The pool's queue links
+ * units through LINK, so a unit may only be queued once at a time: it must
+ * stay valid and must not be pushed again until FUNC is called, after which
+ * the pool no longer references it (FUNC may free it or push it again).
+ */
+struct thread_pool_work
+{
+  void (*func)(void *data);
+  void *data;
+  struct loomlib_link link;
+};
+
 /*
  * Create a new thread pool.
  * MAX_THREADS threads will be started.
@@ -39,6 +56,29 @@ struct thread_pool;
 struct thread_pool *
 thread_pool_new (size_t max_threads);
 
+/*
+ * Create a new thread pool whose work queue holds at most MAX_QUEUED pending
+ * work units.
+ * Once the queue is full THREAD_POOL_PUSH will block until a worker picks up
+ * some work, so producers are slowed down instead of the queue growing
+ * without bound. Work pushed from the pool's own threads is exempt, since
+ * blocking them could leave no thread to drain the queue. A MAX_QUEUED of
+ * zero gives an unbounded queue.
+ */
+struct thread_pool *
+thread_pool_new_bounded (size_t max_threads, size_t max_queued);
+
+/*
+ * Create a new bounded thread pool whose threads are pinned to cores.
+ * CPUS holds MAX_THREADS core numbers, one per thread; a negative entry (or a
+ * NULL CPUS) leaves that thread unpinned. Pinning is silently skipped on
+ * systems which do not support it. Returns NULL if a core number is too
+ * large for the system to name or a thread could not be started.
+ */
+struct thread_pool *
+thread_pool_new_pinned (size_t max_threads, size_t max_queued,
+                        const int *cpus);
+
 /*
  * Free a thread pool.
  * This will block until all of the threads have exited and there is no more
@@ -49,13 +89,33 @@ thread_pool_free (struct thread_pool *pool);
 
 /*
  * Push a new work unit into the pool.
- * EXEC_FUNC must not be NULL.
+ * EXEC_FUNC must not be NULL. If the pool is bounded and its work queue is
+ * full then this blocks until there is room, unless it is called from one of
+ * the pool's own threads.
  */
 bool
 thread_pool_push (struct thread_pool *pool,
                   void(*exec_func)(void *data),
                   void *data);
 
+/*
+ * Push a caller-owned work unit into the pool.
+ * WORK->FUNC must not be NULL. Blocks like THREAD_POOL_PUSH if the pool is
+ * bounded and full.
+ */
+bool
+thread_pool_push_work (struct thread_pool *pool,
+                       struct thread_pool_work *work);
+
+/*
+ * Push a new work unit into the pool without blocking.
+ * Returns false if the work queue is full.
+ */
+bool
+thread_pool_try_push (struct thread_pool *pool,
+                      void(*exec_func)(void *data),
+                      void *data);
+
 /*
  * Wait for all currently queued and executing work units to finish before
  * returning. Any work units queued after a call to thread_pool_barrier_wait
@@ -64,6 +124,15 @@ thread_pool_push (struct thread_pool *pool,
 bool
 thread_pool_barrier_wait (struct thread_pool *pool);
 
+/*
+ * Let at most MAX_ACTIVE (which must be non-zero) of the pool's threads take
+ * work; the rest stand by without spinning until the limit is raised again.
+ * A thread already running a work unit finishes it first. The default is
+ * every thread. THREAD_POOL_TERMINATE lifts the limit.
+ */
+bool
+thread_pool_set_active (struct thread_pool *pool, size_t max_active);
+
 /*
  * Will cause all threads to shut down nicely once all of the work has been
  * finished. No work pushed after this call will be done.
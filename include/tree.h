@@ -25,6 +25,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 /*
  * A tree.
@@ -36,6 +37,50 @@ struct tree;
  */
 struct vertice;
 
+/*
+ * How a tree orders the vertices which are ready to run.
+ * TREE_SCHEDULE_FIFO runs them in the order they became ready, so with many
+ *   iterations in flight the tree is walked breadth first and the products
+ *   of all of them are alive at once.
+ * TREE_SCHEDULE_DEPTH_FIRST runs the vertices of older iterations first, and
+ *   within an iteration the deepest ones first; a new iteration only starts
+ *   when nothing else is ready. This keeps the number of live products close
+ *   to the depth of the tree times the number of threads.
+ */
+enum tree_schedule
+{
+  TREE_SCHEDULE_FIFO,
+  TREE_SCHEDULE_DEPTH_FIRST
+};
+
+/*
+ * Profile of one vertice, see TREE_SET_PROFILE. Times are in nanoseconds.
+ */
+struct tree_vertice_stats
+{
+  uint64_t runs;        /* times the vertice has run */
+  uint64_t busy_nsec;   /* time spent running it */
+  uint64_t wait_nsec;   /* time it spent queued before running */
+  uint64_t path_nsec;   /* longest path of runs within an iteration, from the
+                         * start of the root to the end of this vertice */
+};
+
+/*
+ * Profile of a whole tree, see TREE_SET_PROFILE. WORK_NSEC is the total run
+ * time of every vertice and SPAN_NSEC that of the critical path of every
+ * finished iteration, so PARALLELISM (their ratio) is the average number of
+ * vertices of one iteration that can run at once. Only overlapping
+ * iterations (see TREE_SET_MAX_INFLIGHT) put more threads than that to use.
+ */
+struct tree_stats
+{
+  uint64_t iterations;
+  uint64_t work_nsec;
+  uint64_t span_nsec;
+  uint64_t max_span_nsec;
+  double parallelism;
+};
+
 /*
  * Create a new tree.
  * MAX_THREADS threads will be started.
@@ -46,7 +91,8 @@ tree_new (size_t max_threads);
 /*
  * Free a tree.
  * This will block until all of the threads have exited and there is no more
- * work to be done.
+ * work to be done. The vertices may be freed before the tree, except for
+ * memoized ones (see TREE_SET_MEMO), whose memoized products it releases.
  */
 void
 tree_free (struct tree *tree);
@@ -54,6 +100,55 @@ tree_free (struct tree *tree);
 bool
 tree_terminate (struct tree *tree);
 
+/*
+ * Limit the number of root iterations executing at once to MAX_INFLIGHT
+ * (which must be non-zero). The default is MAX_THREADS + 1.
+ * Once the limit is reached the root is not executed again until an iteration
+ * has finished every one of its vertices; no thread spins waiting for that.
+ * This may be changed while the tree is running.
+ */
+bool
+tree_set_max_inflight (struct tree *tree, size_t max_inflight);
+
+/*
+ * Choose how ready vertices are ordered, see enum TREE_SCHEDULE. The default
+ * is TREE_SCHEDULE_FIFO. Must be set before the tree is executed.
+ */
+bool
+tree_set_schedule (struct tree *tree, enum tree_schedule schedule);
+
+/*
+ * Profile every vertice when ENABLED is true (the default is false). This
+ * costs a couple of clock reads and atomic updates per vertice run.
+ * Must be set before the tree is executed.
+ */
+bool
+tree_set_profile (struct tree *tree, bool enabled);
+
+/*
+ * Take a snapshot of the profile of a running (or finished) tree. Returns
+ * false if the tree is not profiled.
+ */
+bool
+tree_get_stats (struct tree *tree, struct tree_stats *stats);
+
+/*
+ * Take a snapshot of the profile of VERTICE.
+ */
+bool
+tree_get_vertice_stats (struct vertice *vertice,
+                        struct tree_vertice_stats *stats);
+
+/*
+ * Find the critical path of a profiled tree: the chain of vertices, from the
+ * root, along which the longest path of runs in any iteration went. Up to
+ * MAX_PATH of them are stored in PATH. Returns the length of the whole path
+ * (zero if the tree is not profiled).
+ */
+size_t
+tree_get_critical_path (struct tree *tree, struct vertice **path,
+                        size_t max_path);
+
 
 /*
  * Create a new vertice.
@@ -62,12 +157,61 @@ tree_terminate (struct tree *tree);
  *   All children will be passed the same pointer so they must lock sensitive
  *   areas appropriately.
  * Terminal verticies should return NULL since there are no children to handle
- *   the result (if non-null is returned then that memory will leak).
+ *   the result (if non-null is returned then that memory will leak, unless
+ *   a release routine is set).
  */
 struct vertice *
 tree_new_vertice (void *(*routine)(void *data, void *product),
                   void *data);
 
+/*
+ * Create a new join vertice, which has several parents and runs once all of
+ * them have run, instead of once for each of them.
+ * ROUTINE is passed the NUM_PRODUCTS products of its parents in PRODUCTS,
+ * ordered as the parents were given to TREE_ADD_CHILD. PRODUCTS is only
+ * valid during the call.
+ * Every parent of a join must be reachable from the root and run once per
+ * iteration of the root (so it may not itself be a plain vertice with several
+ * parents). A join may not be the root.
+ */
+struct vertice *
+tree_new_join_vertice (void *(*routine)(void *data, void **products,
+                                        size_t num_products),
+                       void *data);
+
+/*
+ * Let the tree manage the lifetime of the products VERTICE returns: RELEASE
+ * is called with the vertice's DATA on each of them as soon as the last of
+ * its children has finished with it (or at once if the vertice has no
+ * children). NULL products are never released.
+ */
+bool
+tree_set_release (struct vertice *vertice,
+                  void (*release)(void *data, void *product));
+
+/*
+ * Memoize VERTICE: KEY is called with the vertice's DATA on each input
+ * PRODUCT (for a join, the array of its inputs) and when it returns the same
+ * key as for the previous input that was run the vertice is skipped, its
+ * children being handed the product it returned then. Keys must therefore
+ * change whenever the input does. A memoized product with a release routine
+ * (see TREE_SET_RELEASE) is kept until it is replaced, invalidated or the
+ * tree is freed.
+ * Must be set before the tree is executed; returns false once it is.
+ */
+bool
+tree_set_memo (struct vertice *vertice,
+               uint64_t (*key)(void *data, void *product));
+
+/*
+ * Mark VERTICE and every vertice below it dirty, so the memoized ones run
+ * again the next time they are reached whatever their key. Use it when
+ * something a vertice depends on besides its input has changed. May be
+ * called while the tree is executing, but not once it has been freed.
+ */
+bool
+tree_invalidate (struct vertice *vertice);
+
 /*
  * Free a vertice.
  * Once the tree is finished executing you must free all of the vertices to
@@ -86,7 +230,11 @@ tree_add_root (struct tree *tree,
 
 /*
  * Designate CHILD to be the child node of PARENT.
- * Each parent may have zero or more children.
+ * Each parent may have zero or more children. A plain vertice with more than
+ * one parent runs once for each of them; a join runs once for all of them,
+ * and linking the same parent to a join twice fails.
+ * The shape of the tree is fixed by TREE_EXECUTE; children added after that
+ * are not run.
  */
 bool
 tree_add_child (struct vertice *parent,
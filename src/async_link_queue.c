@@ -0,0 +1,168 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "link_queue.h"
+#include "async_link_queue.h"
+
+struct async_link_queue
+{
+  struct link_queue queue;
+  size_t capacity;
+  pthread_mutex_t lock;
+  pthread_cond_t nonempty;
+  pthread_cond_t nonfull;
+  pthread_cond_t is_empty;
+};
+
+struct async_link_queue *
+async_link_queue_new (void)
+{
+  return async_link_queue_new_bounded (0);
+}
+
+struct async_link_queue *
+async_link_queue_new_bounded (size_t capacity)
+{
+  struct async_link_queue *queue = malloc (sizeof *queue);
+
+  if (NULL == queue)
+    return NULL;
+
+  link_queue_init (&queue->queue);
+  queue->capacity = capacity;
+  pthread_mutex_init (&queue->lock, NULL);
+  pthread_cond_init (&queue->nonempty, NULL);
+  pthread_cond_init (&queue->nonfull, NULL);
+  pthread_cond_init (&queue->is_empty, NULL);
+
+  return queue;
+}
+
+void
+async_link_queue_free (struct async_link_queue *queue)
+{
+  pthread_mutex_lock (&queue->lock);
+
+  while (0 != link_queue_count (&queue->queue))
+    pthread_cond_wait (&queue->is_empty, &queue->lock);
+
+  pthread_mutex_unlock (&queue->lock);
+
+  pthread_cond_destroy (&queue->is_empty);
+  pthread_cond_destroy (&queue->nonfull);
+  pthread_cond_destroy (&queue->nonempty);
+  pthread_mutex_destroy (&queue->lock);
+  free (queue);
+}
+
+/*
+ * Common body of the push variants. If the queue is full and WAIT is false
+ * this fails immediately, otherwise it blocks until there is room. When
+ * BOUNDED is false the capacity is ignored.
+ */
+static bool
+async_link_queue_push_wait (struct async_link_queue *queue,
+                            struct loomlib_link *link,
+                            const bool wait, const bool bounded)
+{
+  assert (link);
+
+  pthread_mutex_lock (&queue->lock);
+
+  while (bounded && 0 != queue->capacity
+         && queue->capacity <= link_queue_count (&queue->queue))
+    {
+      if (!wait)
+        {
+          pthread_mutex_unlock (&queue->lock);
+          return false;
+        }
+      pthread_cond_wait (&queue->nonfull, &queue->lock);
+    }
+
+  link_queue_push (&queue->queue, link);
+
+  pthread_cond_signal (&queue->nonempty);
+  pthread_mutex_unlock (&queue->lock);
+  return true;
+}
+
+void
+async_link_queue_push (struct async_link_queue *queue,
+                       struct loomlib_link *link)
+{
+  async_link_queue_push_wait (queue, link, true, true);
+}
+
+bool
+async_link_queue_try_push (struct async_link_queue *queue,
+                           struct loomlib_link *link)
+{
+  return async_link_queue_push_wait (queue, link, false, true);
+}
+
+void
+async_link_queue_force_push (struct async_link_queue *queue,
+                             struct loomlib_link *link)
+{
+  async_link_queue_push_wait (queue, link, false, false);
+}
+
+struct loomlib_link *
+async_link_queue_pop (struct async_link_queue *queue, const bool wait)
+{
+  struct loomlib_link *link;
+
+  pthread_mutex_lock (&queue->lock);
+
+  while (NULL == (link = link_queue_pop (&queue->queue)) && wait)
+    pthread_cond_wait (&queue->nonempty, &queue->lock);
+
+  if (link && 0 != queue->capacity
+      && link_queue_count (&queue->queue) < queue->capacity)
+    pthread_cond_signal (&queue->nonfull);
+
+  if (0 == link_queue_count (&queue->queue))
+    pthread_cond_broadcast (&queue->is_empty);
+
+  pthread_mutex_unlock (&queue->lock);
+
+  return link;
+}
+
+size_t
+async_link_queue_count (struct async_link_queue *queue)
+{
+  size_t rv;
+
+  pthread_mutex_lock (&queue->lock);
+  rv = link_queue_count (&queue->queue);
+  pthread_mutex_unlock (&queue->lock);
+
+  return rv;
+}
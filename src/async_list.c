@@ -67,7 +67,7 @@ async_list_get (struct async_list *l, uint64_t i)
   assert (l);
   pthread_mutex_lock (&l->lock);
   assert (l->data);
-  assert (l->count <= i);
+  assert (i < l->count);
   p = l->data[i];
   pthread_mutex_unlock (&l->lock);
   return p;
@@ -20,34 +20,61 @@
  * THE SOFTWARE.
  *****************************************************************************/
 
+#include <assert.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <time.h>
 
-#include "queue.h"
+#include "event.h"
 #include "async_queue.h"
 
+#define ASYNC_QUEUE_MIN_RING 16
+
+/*
+ * Items are kept in a ring of RING_SIZE pointers starting at HEAD. The ring
+ * only grows (doubling, up to CAPACITY) so once a queue has reached its
+ * working size pushing and popping never touch the allocator.
+ */
 struct async_queue {
-  struct queue *queue;
+  void **ring;
+  size_t ring_size;
+  size_t head;
   size_t size;
+  size_t capacity;
+  int event_fd;
   pthread_mutex_t lock;
   pthread_cond_t nonempty;
+  pthread_cond_t nonfull;
   pthread_cond_t is_empty;
 };
 
 struct async_queue *
 async_queue_new (void)
+{
+  return async_queue_new_bounded(0);
+}
+
+struct async_queue *
+async_queue_new_bounded(size_t capacity)
 {
   struct async_queue *queue = malloc (sizeof *queue);
 
   if (queue == NULL)
     return NULL;
 
-  queue->queue = NULL;
+  queue->ring = NULL;
+  queue->ring_size = 0;
+  queue->head = 0;
   queue->size = 0;
+  queue->capacity = capacity;
+  queue->event_fd = -1;
   pthread_mutex_init (&queue->lock, NULL);
   pthread_cond_init (&queue->nonempty, NULL);
+  pthread_cond_init (&queue->nonfull, NULL);
   pthread_cond_init (&queue->is_empty, NULL);
 
   return queue;
@@ -63,21 +90,105 @@ async_queue_free (struct async_queue *queue)
 
   pthread_mutex_unlock(&queue->lock);
 
+  loomlib_event_destroy(queue->event_fd);
   pthread_cond_destroy(&queue->is_empty);
+  pthread_cond_destroy(&queue->nonfull);
   pthread_cond_destroy(&queue->nonempty);
   pthread_mutex_destroy(&queue->lock);
+  free (queue->ring);
   free (queue);
 }
 
-bool
-async_queue_push(struct async_queue *queue, void *item)
+/*
+ * Make room for at least one more item. Must be called with the lock held.
+ */
+static bool
+async_queue_grow(struct async_queue *queue)
+{
+  size_t ring_size;
+  void **ring;
+
+  /* a bounded ring is not grown past its capacity, unless a forced push
+   * has to overflow it */
+  ring_size = queue->ring_size ? queue->ring_size * 2 : ASYNC_QUEUE_MIN_RING;
+  if (queue->capacity != 0 && queue->capacity < ring_size
+      && queue->ring_size < queue->capacity)
+    ring_size = queue->capacity;
+
+  ring = realloc (queue->ring, ring_size * sizeof *ring);
+  if (ring == NULL)
+    return false;
+
+  /* unwrap the items that sat at the front of the old ring so they follow
+   * the items at its end */
+  if (queue->ring_size < queue->head + queue->size)
+    {
+      size_t wrapped = queue->head + queue->size - queue->ring_size;
+      size_t room = ring_size - queue->ring_size;
+
+      if (wrapped <= room)
+        memcpy (ring + queue->ring_size, ring, wrapped * sizeof *ring);
+      else
+        {
+          memcpy (ring + queue->ring_size, ring, room * sizeof *ring);
+          memmove (ring, ring + room, (wrapped - room) * sizeof *ring);
+        }
+    }
+
+  queue->ring = ring;
+  queue->ring_size = ring_size;
+  return true;
+}
+
+/*
+ * Common body of the push variants. If the queue is full and WAIT is false
+ * this fails immediately, otherwise it blocks until there is room or until
+ * ABSTIME passes (when ABSTIME is not NULL). When BOUNDED is false the
+ * capacity is ignored.
+ */
+static bool
+async_queue_push_wait(struct async_queue *queue, void *item, const bool wait,
+                      const struct timespec *abstime, const bool bounded)
 {
   bool rv;
 
   pthread_mutex_lock(&queue->lock);
 
-  if (true == (rv = queue_push(&queue->queue, item)))
-    queue->size++;
+  while (bounded && queue->capacity != 0 && queue->capacity <= queue->size)
+    {
+      if (!wait)
+        {
+          pthread_mutex_unlock(&queue->lock);
+          return false;
+        }
+
+      if (abstime == NULL)
+        pthread_cond_wait (&queue->nonfull, &queue->lock);
+      else if (ETIMEDOUT == pthread_cond_timedwait (&queue->nonfull,
+                                                    &queue->lock, abstime)
+               && queue->capacity <= queue->size)
+        {
+          pthread_mutex_unlock(&queue->lock);
+          return false;
+        }
+    }
+
+  assert (item != NULL);
+
+  if (queue->size < queue->ring_size || async_queue_grow(queue))
+    {
+      size_t tail = queue->head + queue->size;
+
+      if (queue->ring_size <= tail)
+        tail -= queue->ring_size;
+      queue->ring[tail] = item;
+
+      if (queue->size++ == 0)
+        loomlib_event_signal(queue->event_fd);
+      rv = true;
+    }
+  else
+    rv = false;
 
   pthread_cond_broadcast(&queue->nonempty);
   pthread_mutex_unlock(&queue->lock);
@@ -85,26 +196,108 @@ async_queue_push(struct async_queue *queue, void *item)
   return rv;
 }
 
-void *
-async_queue_pop(struct async_queue *queue, const bool wait)
+bool
+async_queue_push(struct async_queue *queue, void *item)
+{
+  return async_queue_push_wait(queue, item, true, NULL, true);
+}
+
+bool
+async_queue_try_push(struct async_queue *queue, void *item)
+{
+  return async_queue_push_wait(queue, item, false, NULL, true);
+}
+
+bool
+async_queue_push_timeout(struct async_queue *queue, void *item,
+                         const struct timespec *abstime)
+{
+  return async_queue_push_wait(queue, item, true, abstime, true);
+}
+
+bool
+async_queue_force_push(struct async_queue *queue, void *item)
+{
+  return async_queue_push_wait(queue, item, false, NULL, false);
+}
+
+/*
+ * Common body of the pop variants. If the queue is empty and WAIT is false
+ * this returns NULL immediately, otherwise it blocks until an item is pushed
+ * or until ABSTIME passes (when ABSTIME is not NULL).
+ */
+static void *
+async_queue_pop_wait(struct async_queue *queue, const bool wait,
+                     const struct timespec *abstime)
 {
-  void *rv;
+  void *rv = NULL;
   pthread_mutex_lock(&queue->lock);
 
-  while ((rv = queue_pop(&queue->queue)) == NULL && wait)
-    pthread_cond_wait (&queue->nonempty, &queue->lock);
+  while (queue->size == 0 && wait)
+    {
+      if (abstime == NULL)
+        pthread_cond_wait (&queue->nonempty, &queue->lock);
+      else if (ETIMEDOUT == pthread_cond_timedwait (&queue->nonempty,
+                                                    &queue->lock, abstime))
+        break;
+    }
 
-  if (rv)
-    queue->size--;
+  if (queue->size != 0)
+    {
+      rv = queue->ring[queue->head];
+      if (++queue->head == queue->ring_size)
+        queue->head = 0;
+
+      if (queue->capacity != 0 && queue->size == queue->capacity)
+        pthread_cond_broadcast(&queue->nonfull);
+      queue->size--;
+    }
 
   if (queue->size == 0)
-    pthread_cond_broadcast(&queue->is_empty);
+    {
+      if (rv)
+        loomlib_event_clear(queue->event_fd);
+      pthread_cond_broadcast(&queue->is_empty);
+    }
 
   pthread_mutex_unlock(&queue->lock);
 
   return rv;
 }
 
+void *
+async_queue_pop(struct async_queue *queue, const bool wait)
+{
+  return async_queue_pop_wait(queue, wait, NULL);
+}
+
+void *
+async_queue_pop_timeout(struct async_queue *queue,
+                        const struct timespec *abstime)
+{
+  return async_queue_pop_wait(queue, true, abstime);
+}
+
+int
+async_queue_eventfd(struct async_queue *queue)
+{
+  int fd;
+
+  pthread_mutex_lock(&queue->lock);
+
+  if (queue->event_fd < 0)
+    {
+      queue->event_fd = loomlib_event_new();
+      if (queue->size != 0)
+        loomlib_event_signal(queue->event_fd);
+    }
+  fd = queue->event_fd;
+
+  pthread_mutex_unlock(&queue->lock);
+
+  return fd;
+}
+
 size_t
 async_queue_count(struct async_queue *queue)
 {
@@ -114,3 +307,9 @@ async_queue_count(struct async_queue *queue)
   pthread_mutex_unlock(&queue->lock);
   return rv;
 }
+
+size_t
+async_queue_capacity(struct async_queue *queue)
+{
+  return queue->capacity;
+}
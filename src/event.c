@@ -0,0 +1,73 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "event.h"
+
+#include <stdint.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+
+int
+loomlib_event_new (void)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  return eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+  return -1;
+#endif
+}
+
+void
+loomlib_event_destroy (int fd)
+{
+  if (0 <= fd)
+    close (fd);
+}
+
+void
+loomlib_event_signal (int fd)
+{
+  uint64_t one = 1;
+
+  /* a failed write means the counter is already non-zero, which is all a
+   * waiter needs to see */
+  if (0 <= fd && write (fd, &one, sizeof one) != sizeof one)
+    return;
+}
+
+void
+loomlib_event_clear (int fd)
+{
+  uint64_t count;
+
+  /* a failed read means the counter was already zero */
+  if (0 <= fd && read (fd, &count, sizeof count) != sizeof count)
+    return;
+}
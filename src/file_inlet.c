@@ -0,0 +1,236 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "file_inlet.h"
+
+/*
+ * How many chunks ahead of the last one handed out are prefetched.
+ */
+#define FILE_INLET_READAHEAD 4
+
+/*
+ * How many released chunk descriptors are kept for reuse.
+ */
+#define FILE_INLET_CACHED_CHUNKS 64
+
+struct file_inlet
+{
+  char *map;
+  size_t size;
+  size_t page_size;
+
+  size_t chunk_size;
+  int delimiter;
+
+  /* where the next chunk starts, and how far the file has been prefetched */
+  size_t next;
+  size_t prefetched;
+
+  /* set if a chunk could not be allocated, which ended the stream early */
+  bool failed;
+
+  struct cache *chunks;
+};
+
+
+struct file_inlet *
+file_inlet_new (const char *path, size_t chunk_size, int delimiter)
+{
+  struct file_inlet *inlet;
+  struct stat st;
+  int fd;
+
+  if (NULL == path || 0 == chunk_size)
+    return NULL;
+
+  if (-1 == (fd = open (path, O_RDONLY)))
+    return NULL;
+
+  if (-1 == fstat (fd, &st) || NULL == (inlet = malloc (sizeof *inlet)))
+    {
+      close (fd);
+      return NULL;
+    }
+
+  inlet->map = NULL;
+  inlet->size = st.st_size;
+  inlet->page_size = sysconf (_SC_PAGESIZE);
+  inlet->chunk_size = chunk_size;
+  inlet->delimiter = delimiter;
+  inlet->next = 0;
+  inlet->prefetched = 0;
+  inlet->failed = false;
+
+  /* an empty file cannot be mapped, but it has no chunks anyway */
+  if (0 < inlet->size)
+    {
+      inlet->map = mmap (NULL, inlet->size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (MAP_FAILED == inlet->map)
+        {
+          close (fd);
+          free (inlet);
+          return NULL;
+        }
+#ifdef MADV_SEQUENTIAL
+      madvise (inlet->map, inlet->size, MADV_SEQUENTIAL);
+#endif
+    }
+  close (fd);
+
+  inlet->chunks = cache_init (FILE_INLET_CACHED_CHUNKS,
+                              sizeof (struct file_chunk), malloc, free);
+  if (NULL == inlet->chunks)
+    {
+      file_inlet_free (inlet);
+      return NULL;
+    }
+
+  return inlet;
+}
+
+void
+file_inlet_free (struct file_inlet *inlet)
+{
+  assert (inlet);
+
+  if (inlet->map)
+    munmap (inlet->map, inlet->size);
+  if (inlet->chunks)
+    cache_destroy (inlet->chunks);
+  free (inlet);
+}
+
+/*
+ * Ask for the pages up to FILE_INLET_READAHEAD chunks past END to be read in.
+ */
+static void
+file_inlet_prefetch (struct file_inlet *inlet, size_t end)
+{
+#ifdef MADV_WILLNEED
+  size_t start = inlet->prefetched & ~(inlet->page_size - 1);
+  size_t stop = end + FILE_INLET_READAHEAD * inlet->chunk_size;
+
+  if (inlet->size < stop)
+    stop = inlet->size;
+  if (stop <= inlet->prefetched)
+    return;
+
+  madvise (inlet->map + start, stop - start, MADV_WILLNEED);
+  inlet->prefetched = stop;
+#else
+  (void) inlet;
+  (void) end;
+#endif
+}
+
+void *
+file_inlet_next (void *data)
+{
+  struct file_inlet *inlet = data;
+  struct file_chunk *chunk;
+  size_t end;
+  char *delim;
+
+  assert (inlet);
+
+  if (inlet->size <= inlet->next)
+    return NULL;
+
+  end = inlet->size - inlet->next <= inlet->chunk_size
+        ? inlet->size
+        : inlet->next + inlet->chunk_size;
+
+  /* run on to the end of the record the chunk ends in */
+  if (0 <= inlet->delimiter && end < inlet->size)
+    {
+      delim = memchr (inlet->map + end - 1, inlet->delimiter,
+                      inlet->size - end + 1);
+      end = delim ? (size_t) (delim - inlet->map) + 1 : inlet->size;
+    }
+
+  if (NULL == (chunk = cache_alloc (inlet->chunks)))
+    {
+      inlet->failed = true;
+      return NULL;
+    }
+
+  chunk->data = inlet->map + inlet->next;
+  chunk->size = end - inlet->next;
+  chunk->offset = inlet->next;
+  inlet->next = end;
+
+  file_inlet_prefetch (inlet, end);
+  return chunk;
+}
+
+bool
+file_inlet_failed (struct file_inlet *inlet)
+{
+  assert (inlet);
+  return inlet->failed;
+}
+
+void
+file_inlet_release (struct file_inlet *inlet, struct file_chunk *chunk)
+{
+  size_t mask, start, stop;
+
+  assert (inlet);
+
+  if (NULL == chunk)
+    return;
+
+  /* drop the pages which lie wholly within the chunk; pages shared with a
+   * neighbouring chunk are left for the kernel to reclaim */
+#ifdef MADV_DONTNEED
+  mask = inlet->page_size - 1;
+  start = (chunk->offset + mask) & ~mask;
+  stop = (chunk->offset + chunk->size) & ~mask;
+  if (chunk->offset + chunk->size == inlet->size)
+    stop = inlet->size;
+  if (start < stop)
+    madvise (inlet->map + start, stop - start, MADV_DONTNEED);
+#else
+  (void) mask;
+  (void) start;
+  (void) stop;
+#endif
+
+  cache_free (inlet->chunks, chunk);
+}
@@ -20,6 +20,7 @@
  * THE SOFTWARE.
  *****************************************************************************/
 
+#include "event.h"
 #include "gamma_queue.h"
 #include "lock.h"
 
@@ -42,6 +43,11 @@ struct gamma_queue
   loomlib_lock_t head_lock;
   loomlib_lock_t tail_lock;
   loomlib_cond_t nonempty;
+
+  /* EVENT_FD is only ever signalled by whoever clears ARMED, so pushes onto a
+   * non-empty queue do not pay for a write */
+  int event_fd;
+  int armed;
 };
 
 
@@ -56,6 +62,7 @@ gamma_queue_new (void)
 
   queue->head = node;
   queue->tail = node;
+  queue->event_fd = -1;
 
   loomlib_lock_init (&queue->head_lock);
   loomlib_lock_init (&queue->tail_lock);
@@ -79,6 +86,7 @@ gamma_queue_free (struct gamma_queue *queue)
   loomlib_lock_destroy (&queue->head_lock);
   loomlib_lock_destroy (&queue->tail_lock);
   loomlib_cond_destroy (&queue->nonempty);
+  loomlib_event_destroy (queue->event_fd);
 
   free (queue);
 }
@@ -87,6 +95,7 @@ bool
 gamma_queue_push (struct gamma_queue *queue, void *item)
 {
   struct node *new;
+  int event_fd;
 
   if (NULL == queue)
     return false;
@@ -101,15 +110,20 @@ gamma_queue_push (struct gamma_queue *queue, void *item)
 
   queue->tail->next = new;
   queue->tail = new;
+  event_fd = queue->event_fd;
 
   loomlib_lock_release (&queue->tail_lock);
   loomlib_cond_broadcast (&queue->nonempty);
 
+  if (0 <= event_fd && __sync_bool_compare_and_swap (&queue->armed, 1, 0))
+    loomlib_event_signal (event_fd);
+
 	return true;
 }
 
-void *
-gamma_queue_pop (struct gamma_queue *queue, bool wait)
+static void *
+gamma_queue_pop_wait (struct gamma_queue *queue, bool wait,
+                      const struct timespec *abstime)
 {
   struct node *temp;
   void *item;
@@ -126,15 +140,81 @@ gamma_queue_pop (struct gamma_queue *queue, bool wait)
     }
 
   while (NULL == queue->head->next)
-    loomlib_cond_wait (&queue->nonempty, &queue->head_lock);
+    {
+      if (NULL == abstime)
+        loomlib_cond_wait (&queue->nonempty, &queue->head_lock);
+      else if (!loomlib_cond_timedwait (&queue->nonempty, &queue->head_lock,
+                                        abstime)
+               && NULL == queue->head->next)
+        {
+          loomlib_lock_release (&queue->head_lock);
+          return NULL;
+        }
+    }
 
   item = queue->head->next->item;
   temp = queue->head;
   queue->head = queue->head->next;
 
+  /* the queue looks empty: clear the descriptor and re-arm it, then look again
+   * in case a push slipped in before the re-arm was visible */
+  if (0 <= queue->event_fd && NULL == queue->head->next)
+    {
+      loomlib_event_clear (queue->event_fd);
+      queue->armed = 1;
+      __sync_synchronize ();
+
+      if (NULL != queue->head->next
+          && __sync_bool_compare_and_swap (&queue->armed, 1, 0))
+        loomlib_event_signal (queue->event_fd);
+    }
+
   loomlib_lock_release (&queue->head_lock);
 
   free (temp);
 
   return item;
 }
+
+void *
+gamma_queue_pop (struct gamma_queue *queue, bool wait)
+{
+  return gamma_queue_pop_wait (queue, wait, NULL);
+}
+
+void *
+gamma_queue_pop_timeout (struct gamma_queue *queue,
+                         const struct timespec *abstime)
+{
+  return gamma_queue_pop_wait (queue, true, abstime);
+}
+
+int
+gamma_queue_eventfd (struct gamma_queue *queue)
+{
+  int fd;
+
+  if (NULL == queue)
+    return -1;
+
+  loomlib_lock_acquire (&queue->head_lock);
+  loomlib_lock_acquire (&queue->tail_lock);
+
+  if (queue->event_fd < 0)
+    {
+      queue->event_fd = loomlib_event_new ();
+      queue->armed = 1;
+
+      if (NULL != queue->head->next)
+        {
+          queue->armed = 0;
+          loomlib_event_signal (queue->event_fd);
+        }
+    }
+  fd = queue->event_fd;
+
+  loomlib_lock_release (&queue->tail_lock);
+  loomlib_lock_release (&queue->head_lock);
+
+  return fd;
+}
@@ -0,0 +1,74 @@
+/******************************************************************************
+ * Copyright (c) 2010 Joey Degges
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *****************************************************************************/
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "link_queue.h"
+
+
+void
+link_queue_init (struct link_queue *queue)
+{
+  assert (queue);
+
+  queue->head = NULL;
+  queue->tail = &queue->head;
+  queue->count = 0;
+}
+
+void
+link_queue_push (struct link_queue *queue, struct loomlib_link *link)
+{
+  assert (queue);
+  assert (link);
+
+  link->next = NULL;
+  *queue->tail = link;
+  queue->tail = &link->next;
+  queue->count++;
+}
+
+struct loomlib_link *
+link_queue_pop (struct link_queue *queue)
+{
+  struct loomlib_link *link;
+
+  assert (queue);
+
+  if (NULL == (link = queue->head))
+    return NULL;
+
+  if (NULL == (queue->head = link->next))
+    queue->tail = &queue->head;
+  queue->count--;
+
+  return link;
+}
+
+size_t
+link_queue_count (const struct link_queue *queue)
+{
+  assert (queue);
+
+  return queue->count;
+}
@@ -1,7 +1,10 @@
 #include "lock.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
 
 
 void
@@ -75,6 +78,24 @@ loomlib_cond_wait (loomlib_cond_t *cond, loomlib_lock_t *lock)
 #endif
 }
 
+bool
+loomlib_cond_timedwait (loomlib_cond_t *cond, loomlib_lock_t *lock,
+                        const struct timespec *abstime)
+{
+#ifdef USE_MUTEX
+  int rv = pthread_cond_timedwait (cond, lock, abstime);
+  assert (0 == rv || ETIMEDOUT == rv);
+  return 0 == rv;
+#else
+  struct timespec now;
+  (void) cond;
+  (void) lock;
+  clock_gettime (CLOCK_REALTIME, &now);
+  return now.tv_sec < abstime->tv_sec
+         || (now.tv_sec == abstime->tv_sec && now.tv_nsec < abstime->tv_nsec);
+#endif
+}
+
 void
 loomlib_cond_broadcast (loomlib_cond_t *p)
 {
@@ -4,6 +4,8 @@
 #define _GNU_SOURCE
 
 #include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
 
 #define USE_MUTEX
 
@@ -36,6 +38,13 @@ loomlib_cond_destroy (loomlib_cond_t *p);
 void
 loomlib_cond_wait (loomlib_cond_t *cond, loomlib_lock_t *lock);
 
+/*
+ * Returns false if ABSTIME (CLOCK_REALTIME) passed before the wait ended.
+ */
+bool
+loomlib_cond_timedwait (loomlib_cond_t *cond, loomlib_lock_t *lock,
+                        const struct timespec *abstime);
+
 void
 loomlib_cond_broadcast (loomlib_cond_t *p);
 
@@ -23,40 +23,397 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <time.h>
 
+#include "cache.h"
+#include "link_queue.h"
 #include "thread_pool.h"
 #include "pipeline.h"
 
+/*
+ * The auto-tuner never raises the in-flight limit beyond this many products
+ * per thread.
+ */
+#define PIPELINE_TUNE_MAX_INFLIGHT 64
+
+struct pipeline_state;
+
+/*
+ * A reorder buffer which lets products through a serial stage in the order
+ * they left the inlet. SLOT is a power of two sized ring indexed by sequence
+ * number and NEXT is the sequence number to let through next.
+ */
+struct pipeline_order
+{
+  struct pipeline_state **slot;
+  size_t size;
+  uint64_t next;
+};
+
+/*
+ * One lane's way through a stage, which it shares with no other lane.
+ * Serial stages let one product per lane through at a time: a product which
+ * arrives while its lane is BUSY (or, for in order stages, before its turn)
+ * waits in ORDER or PENDING and is later run by the thread which holds the
+ * lane. A fan-out numbers the products it emits on the lane from NEXT_SEQ.
+ * DATA is handed to the stage's routine.
+ */
+struct pipeline_gate
+{
+  void *data;
+  uint64_t next_seq;
+  bool busy;
+  struct pipeline_order order;
+  struct link_queue pending;
+  pthread_mutex_t lock;
+};
+
+/*
+ * A pump, or the outlet. A pump has one of: a ROUTINE, run once per product;
+ * a BATCH routine, run once per batch; a FILTER, run once per product to
+ * decide whether to keep it; or a FANOUT, run once per product to emit new
+ * products. It has a GATE for each lane of the pipe.
+ * Products reach a stage with its own worker group through that group's work
+ * queue, and leave it through the queue of whoever runs the next stage.
+ */
+struct pipeline_stage
+{
+  void *(*routine)(void *data, void *product);
+  size_t (*batch)(void *data, void **products, size_t count);
+  bool (*filter)(void *data, void *product);
+  void (*fanout)(void *data, void *product,
+                 struct pipeline_emitter *emitter);
+  enum pipeline_mode mode;
+  struct pipeline_gate *gate;
+
+  /* a group of WORKERS dedicated to this stage, or NULL to share the pipe's
+   * pool */
+  struct thread_pool *pool;
+  size_t workers;
+
+  /* products a fan-out emitted which are still in flight, kept under the
+   * pipe's lock */
+  size_t emitted;
+
+  /* only kept up to date when the pipe collects statistics */
+  struct pipeline_stage_stats stats;
+};
+
 struct pipeline
 {
   struct thread_pool *pool;
 
   void *(*inlet)(void *data);
+  size_t (*batch_inlet)(void *data, void **products, size_t max);
+  void *(*partitioned_inlet)(void *data, size_t partition);
   void *inlet_data;
 
+  /* inlets which may run at once, and those which have not yet dried up */
+  size_t num_inlets;
+  size_t live_inlets;
+
   void(*outlet)(void *data, void *product);
+  void (*batch_outlet)(void *data, void **products, size_t count);
   void *outlet_data;
+  struct pipeline_stage outlet_stage;
 
-  void *(**pump)(void *data, void *product);
-  void **pump_data;
+  struct pipeline_stage **pump;
   size_t num_pumps;
   size_t max_pumps;
 
   size_t max_threads;
+
+  /* products move through the pipe in batches of up to BATCH_SIZE; the inlet
+   * stops filling a batch early once FLUSH_USEC have passed */
+  size_t batch_size;
+  unsigned long flush_usec;
+
+  /* admission control: at most MAX_INFLIGHT products are between the inlet
+   * and the outlet. When the limit is reached inlet tasks are parked in
+   * PARKED and only rescheduled once a product leaves the pipe. STALLED
+   * fan-outs which went over the limit wait on ROOM (see
+   * PIPELINE_EMIT_WAIT). */
+  size_t max_inflight;
   size_t active_lines;
+  struct link_queue parked;
+  size_t stalled;
+  pthread_cond_t room;
+
+  /* auto-tuning, when TUNE_INTERVAL (in nanoseconds) is non-zero: see
+   * PIPELINE_TUNE. ACTIVE_WORKERS is how many of the pool's threads are
+   * allowed to take work. */
+  uint64_t tune_interval;
+  uint64_t tune_max_latency;
+  bool tune_workers;
+  size_t active_workers;
+  struct pipeline_tuner
+  {
+    uint64_t start;
+    uint64_t products;
+    uint64_t latency;
+    double last_rate;
+    int step[2];
+    int knob;
+  } tuner;
+
+  /* STATE_CACHE recycles product states, which are all the same size once
+   * the pipe is running. Products themselves are handed back to
+   * PRODUCT_CACHE after the outlet, if there is one. */
+  struct cache *state_cache;
+  struct cache *product_cache;
+
+  /* products are split between NUM_LANES lanes by the hash KEY gives them,
+   * and numbered within their lane from NEXT_SEQ */
+  size_t num_lanes;
+  size_t (*key)(void *data, void *product);
+  void *key_data;
+  uint64_t *next_seq;
+
+  /* when FUSED is set a worker carries a product through consecutive stages
+   * instead of handing it back to the pool after each one */
+  bool fused;
+
+  /* when COLLECT_STATS is set each stage keeps its own statistics, and the
+   * inlets' are kept in INLET_STATS */
+  bool collect_stats;
+  struct pipeline_stage_stats inlet_stats;
+
+  /* in pull mode there is no outlet: products wait in OUTBOX (holding
+   * READY products, TAKEN of those in its first batch already taken) until
+   * PIPELINE_NEXT takes them, and the inlet only runs while fewer products
+   * are in flight or ready than WAITING callers plus LOOKAHEAD want */
+  bool pull;
+  size_t lookahead;
+  size_t waiting;
+  size_t ready;
+  size_t taken;
+  struct link_queue outbox;
+  pthread_cond_t pulled;
+
+  /* set once every inlet has dried up (or the pipe was terminated) */
+  bool dry;
   bool terminated;
   pthread_mutex_t lock;
 };
 
 struct pipeline_state
 {
+    struct thread_pool_work work;
+    struct loomlib_link link;
     struct pipeline *pipe;
-    void *product;
     int current_stage;
+    size_t partition;
+    size_t lane;
+    uint64_t seq;
+    uint64_t ready_at;
+    uint64_t entered_at;
+    struct pipeline_stage *origin;
+    bool drain;
+    size_t count;
+    void *products[];
+};
+
+/*
+ * Collects the products a fan-out stage emits for one batch into new
+ * batches, which start at stage NEXT_STAGE. STATE is the batch being filled
+ * and LAST the last one filled, which is held back so that the caller can
+ * carry it on. CROWDED is set if STATE took the pipe over its in-flight
+ * limit.
+ */
+struct pipeline_emitter
+{
+  struct pipeline *pipe;
+  struct pipeline_stage *stage;
+  int next_stage;
+  size_t lane;
+  uint64_t entered_at;
+  struct pipeline_state *state;
+  struct pipeline_state *last;
+  bool crowded;
 };
 
+static void
+pipeline_loop (void *data);
+
+static struct pipeline_state *
+pipeline_enter (struct pipeline *pipe, struct pipeline_state *state);
+
+static void
+pipeline_shutdown (struct pipeline *pipe);
+
+/*
+ * The time in nanoseconds, for statistics.
+ */
+static uint64_t
+pipeline_clock (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static struct pipeline_state *
+pipeline_state_new (struct pipeline *pipe, int current_stage)
+{
+  struct pipeline_state *state;
+
+  state = cache_alloc (pipe->state_cache);
+  if (NULL == state)
+    return NULL;
+
+  state->work.func = pipeline_loop;
+  state->work.data = state;
+  state->pipe = pipe;
+  state->current_stage = current_stage;
+  state->lane = 0;
+  state->seq = 0;
+  state->origin = NULL;
+  state->drain = false;
+  state->count = 0;
+  return state;
+}
+
+static void
+pipeline_state_free (struct pipeline *pipe, struct pipeline_state *state)
+{
+  cache_free (pipe->state_cache, state);
+}
+
+/*
+ * Place STATE of PIPE in the buffer.
+ * The ring only has to hold products that are in flight, so it is sized for
+ * the in-flight limit up front and only grows if the limit is raised while
+ * running.
+ */
+static void
+pipeline_order_insert (struct pipeline *pipe, struct pipeline_order *order,
+                       struct pipeline_state *state)
+{
+  if (order->size <= state->seq - order->next)
+    {
+      size_t size = order->size ? order->size : 1;
+      struct pipeline_state **slot;
+      size_t hint;
+      uint64_t i;
+
+      /* the limit may be changed (by autotuning, say) as we go */
+      pthread_mutex_lock (&pipe->lock);
+      hint = pipe->max_inflight;
+      pthread_mutex_unlock (&pipe->lock);
+
+      while (size <= state->seq - order->next || size < hint)
+        size *= 2;
+
+      slot = calloc (size, sizeof *slot);
+      assert (slot);
+
+      for (i = order->next; i < order->next + order->size; i++)
+        slot[i & (size - 1)] = order->slot[i & (order->size - 1)];
+
+      free (order->slot);
+      order->slot = slot;
+      order->size = size;
+    }
+
+  order->slot[state->seq & (order->size - 1)] = state;
+}
+
+/*
+ * Take the next product in sequence from the buffer, or NULL if it has not
+ * arrived yet.
+ */
+static struct pipeline_state *
+pipeline_order_take (struct pipeline_order *order)
+{
+  struct pipeline_state *state;
+
+  if (0 == order->size)
+    return NULL;
+
+  state = order->slot[order->next & (order->size - 1)];
+  if (state)
+    {
+      order->slot[order->next & (order->size - 1)] = NULL;
+      order->next++;
+    }
+  return state;
+}
+
+static struct pipeline_gate *
+pipeline_gates_new (size_t num_lanes, void *data)
+{
+  struct pipeline_gate *gate = malloc (num_lanes * sizeof *gate);
+  size_t i;
+
+  assert (gate);
+
+  for (i = 0; i < num_lanes; i++)
+    {
+      gate[i].data = data;
+      gate[i].next_seq = 0;
+      gate[i].busy = false;
+      gate[i].order.slot = NULL;
+      gate[i].order.size = 0;
+      gate[i].order.next = 0;
+      link_queue_init (&gate[i].pending);
+      pthread_mutex_init (&gate[i].lock, NULL);
+    }
+
+  return gate;
+}
+
+static void
+pipeline_gates_free (struct pipeline_gate *gate, size_t num_lanes)
+{
+  size_t i;
+
+  for (i = 0; i < num_lanes; i++)
+    {
+      pthread_mutex_destroy (&gate[i].lock);
+      free (gate[i].order.slot);
+    }
+  free (gate);
+}
+
+static void
+pipeline_stage_init (struct pipeline_stage *stage,
+                     size_t num_lanes,
+                     void *data,
+                     enum pipeline_mode mode)
+{
+  stage->routine = NULL;
+  stage->batch = NULL;
+  stage->filter = NULL;
+  stage->fanout = NULL;
+  stage->mode = mode;
+  stage->gate = pipeline_gates_new (num_lanes, data);
+  stage->pool = NULL;
+  stage->workers = 0;
+  stage->emitted = 0;
+  memset (&stage->stats, 0, sizeof stage->stats);
+}
+
+static void
+pipeline_stage_destroy (struct pipeline_stage *stage, size_t num_lanes)
+{
+  if (stage->pool)
+    thread_pool_free (stage->pool);
+  pipeline_gates_free (stage->gate, num_lanes);
+}
+
+static struct pipeline_stage *
+pipeline_stage_at (struct pipeline *pipe, size_t current_stage)
+{
+  if (current_stage < pipe->num_pumps)
+    return pipe->pump[current_stage];
+  return &pipe->outlet_stage;
+}
+
 struct pipeline *
 pipeline_new (size_t max_threads)
 {
@@ -67,6 +424,17 @@ pipeline_new (size_t max_threads)
   assert (pipe->pool);
 
   pipe->max_threads = max_threads;
+  pipe->max_inflight = max_threads + 1;
+  pipe->active_workers = max_threads;
+  link_queue_init (&pipe->parked);
+  link_queue_init (&pipe->outbox);
+  pthread_cond_init (&pipe->pulled, NULL);
+  pthread_cond_init (&pipe->room, NULL);
+  pipe->batch_size = 1;
+  pipe->num_lanes = 1;
+  pipe->next_seq = calloc (1, sizeof *pipe->next_seq);
+  assert (pipe->next_seq);
+  pipeline_stage_init (&pipe->outlet_stage, 1, NULL, PIPELINE_PARALLEL);
   pthread_mutex_init (&pipe->lock, NULL);
 
   return pipe;
@@ -75,195 +443,1501 @@ pipeline_new (size_t max_threads)
 void
 pipeline_free (struct pipeline *pipe)
 {
+  struct loomlib_link *link;
+  size_t i;
+
   assert (pipe);
   assert (pipe->pool);
 
+  /* a pipe that never ran (say it failed to execute) never dries up */
+  if (NULL == pipe->state_cache)
+    pipeline_shutdown (pipe);
+
+  /* a worker group may send the last product out of the pipe and shut it
+   * down, so every thread has to be gone before anything is torn down */
+  for (i = 0; i < pipe->num_pumps; i++)
+    if (pipe->pump[i]->pool)
+      {
+        thread_pool_free (pipe->pump[i]->pool);
+        pipe->pump[i]->pool = NULL;
+      }
   thread_pool_free (pipe->pool);
+  pthread_cond_destroy (&pipe->pulled);
+  pthread_cond_destroy (&pipe->room);
   pthread_mutex_destroy (&pipe->lock);
 
-  free (pipe->pump_data);
+  /* products nobody pulled */
+  while (NULL != (link = link_queue_pop (&pipe->outbox)))
+    pipeline_state_free (pipe, LOOMLIB_CONTAINER_OF (link,
+                                                     struct pipeline_state,
+                                                     link));
+
+  if (pipe->state_cache)
+    cache_destroy (pipe->state_cache);
+
+  for (i = 0; i < pipe->num_pumps; i++)
+    {
+      pipeline_stage_destroy (pipe->pump[i], pipe->num_lanes);
+      free (pipe->pump[i]);
+    }
+  pipeline_stage_destroy (&pipe->outlet_stage, pipe->num_lanes);
+  free (pipe->next_seq);
+
   free (pipe->pump);
   free (pipe);
 }
 
+/*
+ * How many more batches the inlet may send into the pipe right now.
+ * Must be called with the lock held.
+ */
+static size_t
+pipeline_room (struct pipeline *pipe)
+{
+  size_t room, wanted, have;
+
+  if (pipe->max_inflight <= pipe->active_lines)
+    return 0;
+  room = pipe->max_inflight - pipe->active_lines;
+
+  /* when pulled, only make what has been asked for */
+  if (pipe->pull)
+    {
+      wanted = pipe->waiting + pipe->lookahead;
+      have = pipe->active_lines * pipe->batch_size + pipe->ready;
+      if (wanted <= have)
+        return 0;
+      wanted = (wanted - have + pipe->batch_size - 1) / pipe->batch_size;
+      if (wanted < room)
+        room = wanted;
+    }
+
+  return room;
+}
+
+/*
+ * Move as many parked inlets to READY as there is room in the pipe for (or
+ * all of them if the pipe was terminated, so that they can finish).
+ * Must be called with the lock held.
+ */
+static void
+pipeline_unpark (struct pipeline *pipe, struct link_queue *ready)
+{
+  struct pipeline_state *state;
+  struct loomlib_link *link;
+  size_t room;
+
+  room = pipe->terminated ? link_queue_count (&pipe->parked)
+                          : pipeline_room (pipe);
+
+  for (; room; room--)
+    {
+      if (NULL == (link = link_queue_pop (&pipe->parked)))
+        break;
+
+      /* a parked inlet keeps the time it was parked in READY_AT */
+      state = LOOMLIB_CONTAINER_OF (link, struct pipeline_state, link);
+      if (pipe->collect_stats)
+        pipe->inlet_stats.wait_nsec += pipeline_clock () - state->ready_at;
+      link_queue_push (ready, link);
+    }
+}
+
+/*
+ * Reschedule the inlets taken by PIPELINE_UNPARK.
+ */
+static void
+pipeline_resume (struct pipeline *pipe, struct link_queue *ready)
+{
+  struct loomlib_link *link;
+
+  while (NULL != (link = link_queue_pop (ready)))
+    thread_pool_push_work (pipe->pool,
+                           &LOOMLIB_CONTAINER_OF (link, struct pipeline_state,
+                                                  link)->work);
+}
+
 bool
 pipeline_terminate (struct pipeline *pipe)
 {
+  struct link_queue ready;
+
   assert (pipe);
 
+  link_queue_init (&ready);
+
   pthread_mutex_lock (&pipe->lock);
   pipe->terminated = true;
+  pipeline_unpark (pipe, &ready);
   pthread_mutex_unlock (&pipe->lock);
+
+  pipeline_resume (pipe, &ready);
   return true;
 }
 
 bool
-pipeline_add_inlet (struct pipeline *pipe,
-                    void *(*routine)(void *data),
-                    void *data)
+pipeline_set_max_inflight (struct pipeline *pipe, size_t max_inflight)
 {
+  struct link_queue ready;
+
   assert (pipe);
 
+  if (0 == max_inflight)
+    return false;
+
+  link_queue_init (&ready);
+
   pthread_mutex_lock (&pipe->lock);
+  pipe->max_inflight = max_inflight;
+  pipeline_unpark (pipe, &ready);
+  pthread_cond_broadcast (&pipe->room);
+  pthread_mutex_unlock (&pipe->lock);
 
-  assert (!pipe->inlet);
-  assert (!pipe->inlet_data);
-  assert (routine);
+  pipeline_resume (pipe, &ready);
+  return true;
+}
 
-  pipe->inlet = routine;
-  pipe->inlet_data = data;
+bool
+pipeline_set_ordered (struct pipeline *pipe, bool ordered)
+{
+  assert (pipe);
 
+  pthread_mutex_lock (&pipe->lock);
+  if (pipe->state_cache)
+    {
+      pthread_mutex_unlock (&pipe->lock);
+      return false;
+    }
+  pipe->outlet_stage.mode = ordered ? PIPELINE_SERIAL_IN_ORDER
+                                    : PIPELINE_PARALLEL;
   pthread_mutex_unlock (&pipe->lock);
   return true;
 }
 
 bool
-pipeline_add_outlet (struct pipeline *pipe,
-                     void(*routine)(void *data, void *product),
-                     void *data)
+pipeline_set_pull (struct pipeline *pipe, size_t lookahead)
 {
   assert (pipe);
 
   pthread_mutex_lock (&pipe->lock);
 
-  assert (!pipe->outlet);
-  assert (!pipe->outlet_data);
-  assert (routine);
+  assert (!pipe->outlet && !pipe->batch_outlet);
+  assert (!pipe->state_cache);
 
-  pipe->outlet = routine;
-  pipe->outlet_data = data;
+  pipe->pull = true;
+  pipe->lookahead = lookahead;
 
   pthread_mutex_unlock (&pipe->lock);
   return true;
 }
 
 bool
-pipeline_add_pump (struct pipeline *pipe,
-                   void *(*routine)(void *data, void *product),
-                   void *data)
+pipeline_set_lanes (struct pipeline *pipe,
+                    size_t num_lanes,
+                    size_t (*key)(void *data, void *product),
+                    void *data)
 {
   assert (pipe);
-  assert (routine);
+  assert (key);
+
+  if (0 == num_lanes)
+    return false;
 
   pthread_mutex_lock (&pipe->lock);
 
-  if (0 == pipe->max_pumps)
+  /* the pumps' gates are already laid out for the lanes there were, and
+   * lanes cannot hold batches */
+  if (0 != pipe->num_pumps || 1 != pipe->batch_size || pipe->state_cache)
     {
-      pipe->max_pumps = 1;
-      pipe->pump = malloc (sizeof *pipe->pump);
-      pipe->pump_data = malloc (sizeof *pipe->pump_data);
+      pthread_mutex_unlock (&pipe->lock);
+      return false;
     }
-  else if (pipe->max_pumps <= pipe->num_pumps)
-    {
-      pipe->max_pumps *= 2;
 
-      pipe->pump = realloc (pipe->pump, (sizeof *pipe->pump) * pipe->max_pumps);
-      assert (pipe->pump);
+  free (pipe->next_seq);
+  pipe->next_seq = calloc (num_lanes, sizeof *pipe->next_seq);
+  assert (pipe->next_seq);
 
-      pipe->pump_data = realloc (pipe->pump_data,
-                                 (sizeof *pipe->pump_data) * pipe->max_pumps);
-      assert (pipe->pump_data);
-    }
+  pipeline_gates_free (pipe->outlet_stage.gate, pipe->num_lanes);
+  pipe->outlet_stage.gate = pipeline_gates_new (num_lanes, NULL);
 
-  pipe->pump[pipe->num_pumps] = routine;
-  pipe->pump_data[pipe->num_pumps] = data;
-  pipe->num_pumps++;
+  pipe->num_lanes = num_lanes;
+  pipe->key = key;
+  pipe->key_data = data;
 
   pthread_mutex_unlock (&pipe->lock);
   return true;
 }
 
-static void
-pipeline_loop (void *data)
+bool
+pipeline_set_lane_data (struct pipeline *pipe, size_t pump, size_t lane,
+                        void *data)
 {
-  struct pipeline_state *state = data;
-  struct pipeline *pipe = state->pipe;
-  int current_stage = state->current_stage;
-  void *product = state->product;
-  void *new_product;
+  assert (pipe);
 
-  /* inject product from the inlet into the pipe */
-  if (current_stage < 0)
-    {
-      pthread_mutex_lock (&pipe->lock);
-      if (pipe->terminated)
-        {
-          pthread_mutex_unlock (&pipe->lock);
-          free (state);
-          return;
-        }
+  pthread_mutex_lock (&pipe->lock);
 
-      if (pipe->max_threads < pipe->active_lines)
-        {
-          pthread_mutex_unlock (&pipe->lock);
-          thread_pool_push (pipe->pool, pipeline_loop, state);
-          return;
-        }
-      pipe->active_lines++;
+  if (pipe->num_pumps <= pump || pipe->num_lanes <= lane)
+    {
       pthread_mutex_unlock (&pipe->lock);
+      return false;
+    }
 
-      new_product = pipe->inlet (pipe->inlet_data);
+  pipe->pump[pump]->gate[lane].data = data;
 
-      /* if the inlet hasn't dried up, restart this inlet stage */
-      if (new_product)
-        {
-          struct pipeline_state *new_state = malloc (sizeof *new_state);
-          assert (new_state);
+  pthread_mutex_unlock (&pipe->lock);
+  return true;
+}
 
-          new_state->pipe = pipe;
-          new_state->product = NULL;
-          new_state->current_stage = current_stage;
-          thread_pool_push (pipe->pool, pipeline_loop, new_state);
-        }
-      /* if it has dried up then clean up resources */
-      else
-        {
-          free (state);
-          pthread_mutex_lock (&pipe->lock);
-          if (0 == --pipe->active_lines)
-            thread_pool_terminate (pipe->pool);
-          pthread_mutex_unlock (&pipe->lock);
-          return;
-        }
+bool
+pipeline_set_batch (struct pipeline *pipe, size_t batch_size,
+                    unsigned long flush_usec)
+{
+  assert (pipe);
+
+  if (0 == batch_size)
+    return false;
+
+  pthread_mutex_lock (&pipe->lock);
+  if (pipe->state_cache || (1 != pipe->num_lanes && 1 != batch_size))
+    {
+      pthread_mutex_unlock (&pipe->lock);
+      return false;
     }
-  /* pump product through the pipe */
-  else if ((size_t) current_stage < pipe->num_pumps)
+  pipe->batch_size = batch_size;
+  pipe->flush_usec = flush_usec;
+  pthread_mutex_unlock (&pipe->lock);
+  return true;
+}
+
+bool
+pipeline_set_autotune (struct pipeline *pipe,
+                       unsigned long interval_usec,
+                       unsigned long max_latency_usec,
+                       bool tune_workers)
+{
+  assert (pipe);
+
+  pthread_mutex_lock (&pipe->lock);
+  if (pipe->state_cache)
     {
-      new_product = pipe->pump[current_stage] (pipe->pump_data[current_stage],
-                                               product);
+      pthread_mutex_unlock (&pipe->lock);
+      return false;
     }
-  /* deposit product at the outlet */
-  else
+  pipe->tune_interval = interval_usec * (uint64_t) 1000;
+  pipe->tune_max_latency = max_latency_usec * (uint64_t) 1000;
+  pipe->tune_workers = tune_workers;
+  pipe->tuner.start = 0;
+  pipe->tuner.products = 0;
+  pipe->tuner.latency = 0;
+  pipe->tuner.last_rate = 0;
+  pipe->tuner.step[0] = 1;
+  pipe->tuner.step[1] = 1;
+  pipe->tuner.knob = 0;
+  pthread_mutex_unlock (&pipe->lock);
+  return true;
+}
+
+void
+pipeline_get_tuning (struct pipeline *pipe,
+                     size_t *max_inflight,
+                     size_t *active_workers)
+{
+  assert (pipe);
+
+  pthread_mutex_lock (&pipe->lock);
+  if (max_inflight)
+    *max_inflight = pipe->max_inflight;
+  if (active_workers)
+    *active_workers = pipe->active_workers;
+  pthread_mutex_unlock (&pipe->lock);
+}
+
+bool
+pipeline_set_product_cache (struct pipeline *pipe, struct cache *cache)
+{
+  assert (pipe);
+
+  pthread_mutex_lock (&pipe->lock);
+  if (pipe->state_cache)
     {
-      pipe->outlet (pipe->outlet_data, product);
+      pthread_mutex_unlock (&pipe->lock);
+      return false;
+    }
+  pipe->product_cache = cache;
+  pthread_mutex_unlock (&pipe->lock);
+  return true;
+}
 
-      free (state);
-      pthread_mutex_lock (&pipe->lock);
-      if (0 == --pipe->active_lines)
-        thread_pool_terminate (pipe->pool);
+bool
+pipeline_set_stats (struct pipeline *pipe, bool enabled)
+{
+  assert (pipe);
+
+  pthread_mutex_lock (&pipe->lock);
+  if (pipe->state_cache)
+    {
       pthread_mutex_unlock (&pipe->lock);
-      return;
+      return false;
     }
+  pipe->collect_stats = enabled;
+  pthread_mutex_unlock (&pipe->lock);
+  return true;
+}
 
-  /* start up the next stage, passing the new product along */
-  state->product = new_product;
-  state->current_stage++;
-  thread_pool_push (pipe->pool, pipeline_loop, state);
+/*
+ * How busy a stage has been for each thread able to run it.
+ */
+static uint64_t
+pipeline_load (const struct pipeline_stage_stats *stats)
+{
+  return stats->busy_nsec / (stats->workers ? stats->workers : 1);
 }
 
 bool
-pipeline_execute (struct pipeline *pipe)
+pipeline_get_stats (struct pipeline *pipe,
+                    struct pipeline_stats *stats,
+                    struct pipeline_stage_stats *stages,
+                    size_t max_stages)
 {
-  struct pipeline_state *state = malloc (sizeof *state);
+  struct pipeline_stage_stats stage_stats;
+  struct pipeline_stage *stage;
+  uint64_t load, max_load;
+  size_t i;
 
-  assert (state);
   assert (pipe);
-  assert (pipe->pool);
-  assert (pipe->inlet);
-  assert (pipe->outlet);
+  assert (stats);
 
-  state->pipe = pipe;
-  state->current_stage = -1;
+  if (!pipe->collect_stats)
+    return false;
+
+  pthread_mutex_lock (&pipe->lock);
+  stats->inlet = pipe->inlet_stats;
+  stats->inlet.in_flight = link_queue_count (&pipe->parked);
+  stats->active_lines = pipe->active_lines;
+  pthread_mutex_unlock (&pipe->lock);
+
+  stats->inlet.workers = pipe->num_inlets;
+  stats->num_stages = pipe->num_pumps + 1;
+  stats->bottleneck = -1;
+  max_load = pipeline_load (&stats->inlet);
 
-  return thread_pool_push (pipe->pool, pipeline_loop, state);
+  for (i = 0; i < stats->num_stages; i++)
+    {
+      stage = pipeline_stage_at (pipe, i);
+
+      /* the counters are updated without a lock, so this is only a
+       * snapshot and not necessarily a consistent one */
+      stage_stats = stage->stats;
+      if (PIPELINE_PARALLEL != stage->mode)
+        stage_stats.workers = 1;
+      else
+        stage_stats.workers = stage->pool ? stage->workers : pipe->max_threads;
+
+      load = pipeline_load (&stage_stats);
+      if (max_load < load)
+        {
+          max_load = load;
+          stats->bottleneck = i;
+        }
+
+      if (i < max_stages)
+        stages[i] = stage_stats;
+    }
+
+  return true;
+}
+
+bool
+pipeline_set_fused (struct pipeline *pipe, bool fused)
+{
+  assert (pipe);
+
+  pthread_mutex_lock (&pipe->lock);
+  if (pipe->state_cache)
+    {
+      pthread_mutex_unlock (&pipe->lock);
+      return false;
+    }
+  pipe->fused = fused;
+  pthread_mutex_unlock (&pipe->lock);
+  return true;
+}
+
+bool
+pipeline_set_pump_workers (struct pipeline *pipe, size_t pump,
+                           size_t num_threads, const int *cpus)
+{
+  struct pipeline_stage *stage;
+
+  assert (pipe);
+
+  if (0 == num_threads)
+    return false;
+
+  pthread_mutex_lock (&pipe->lock);
+
+  if (pipe->num_pumps <= pump || NULL != pipe->pump[pump]->pool)
+    {
+      pthread_mutex_unlock (&pipe->lock);
+      return false;
+    }
+
+  stage = pipe->pump[pump];
+  stage->pool = thread_pool_new_pinned (num_threads, 0, cpus);
+  if (NULL == stage->pool)
+    {
+      pthread_mutex_unlock (&pipe->lock);
+      return false;
+    }
+  stage->workers = num_threads;
+
+  pthread_mutex_unlock (&pipe->lock);
+  return true;
+}
+
+bool
+pipeline_add_inlet (struct pipeline *pipe,
+                    void *(*routine)(void *data),
+                    void *data)
+{
+  assert (pipe);
+
+  pthread_mutex_lock (&pipe->lock);
+
+  assert (!pipe->inlet && !pipe->batch_inlet && !pipe->partitioned_inlet);
+  assert (!pipe->inlet_data);
+  assert (routine);
+
+  pipe->inlet = routine;
+  pipe->inlet_data = data;
+  pipe->num_inlets = 1;
+
+  pthread_mutex_unlock (&pipe->lock);
+  return true;
+}
+
+bool
+pipeline_add_batch_inlet (struct pipeline *pipe,
+                          size_t (*routine)(void *data, void **products,
+                                            size_t max),
+                          void *data)
+{
+  assert (pipe);
+
+  pthread_mutex_lock (&pipe->lock);
+
+  assert (!pipe->inlet && !pipe->batch_inlet && !pipe->partitioned_inlet);
+  assert (!pipe->inlet_data);
+  assert (routine);
+
+  pipe->batch_inlet = routine;
+  pipe->inlet_data = data;
+  pipe->num_inlets = 1;
+
+  pthread_mutex_unlock (&pipe->lock);
+  return true;
+}
+
+bool
+pipeline_add_partitioned_inlet (struct pipeline *pipe,
+                                void *(*routine)(void *data,
+                                                 size_t partition),
+                                void *data,
+                                size_t num_partitions)
+{
+  assert (pipe);
+
+  if (0 == num_partitions)
+    return false;
+
+  pthread_mutex_lock (&pipe->lock);
+
+  assert (!pipe->inlet && !pipe->batch_inlet && !pipe->partitioned_inlet);
+  assert (!pipe->inlet_data);
+  assert (routine);
+
+  pipe->partitioned_inlet = routine;
+  pipe->inlet_data = data;
+  pipe->num_inlets = num_partitions;
+
+  pthread_mutex_unlock (&pipe->lock);
+  return true;
+}
+
+bool
+pipeline_add_outlet (struct pipeline *pipe,
+                     void(*routine)(void *data, void *product),
+                     void *data)
+{
+  assert (pipe);
+
+  pthread_mutex_lock (&pipe->lock);
+
+  assert (!pipe->outlet && !pipe->batch_outlet);
+  assert (!pipe->outlet_data);
+  assert (routine);
+
+  pipe->outlet = routine;
+  pipe->outlet_data = data;
+
+  pthread_mutex_unlock (&pipe->lock);
+  return true;
+}
+
+bool
+pipeline_add_batch_outlet (struct pipeline *pipe,
+                           void (*routine)(void *data, void **products,
+                                           size_t count),
+                           void *data)
+{
+  assert (pipe);
+
+  pthread_mutex_lock (&pipe->lock);
+
+  assert (!pipe->outlet && !pipe->batch_outlet);
+  assert (!pipe->outlet_data);
+  assert (routine);
+
+  pipe->batch_outlet = routine;
+  pipe->outlet_data = data;
+
+  pthread_mutex_unlock (&pipe->lock);
+  return true;
+}
+
+bool
+pipeline_add_pump (struct pipeline *pipe,
+                   void *(*routine)(void *data, void *product),
+                   void *data)
+{
+  return pipeline_add_pump_mode (pipe, routine, data, PIPELINE_PARALLEL);
+}
+
+/*
+ * Create a pump stage; the caller sets its routine.
+ */
+static struct pipeline_stage *
+pipeline_stage_new (struct pipeline *pipe, void *data, enum pipeline_mode mode)
+{
+  struct pipeline_stage *stage;
+
+  assert (PIPELINE_PARALLEL == mode
+          || PIPELINE_SERIAL_IN_ORDER == mode
+          || PIPELINE_SERIAL_OUT_OF_ORDER == mode);
+
+  stage = malloc (sizeof *stage);
+  assert (stage);
+  pipeline_stage_init (stage, pipe->num_lanes, data, mode);
+  return stage;
+}
+
+/*
+ * Append STAGE to the pumps.
+ */
+static bool
+pipeline_add_stage (struct pipeline *pipe, struct pipeline_stage *stage)
+{
+  assert (pipe);
+
+  pthread_mutex_lock (&pipe->lock);
+
+  if (pipe->max_pumps <= pipe->num_pumps)
+    {
+      pipe->max_pumps = pipe->max_pumps ? pipe->max_pumps * 2 : 1;
+
+      pipe->pump = realloc (pipe->pump, (sizeof *pipe->pump) * pipe->max_pumps);
+      assert (pipe->pump);
+    }
+
+  pipe->pump[pipe->num_pumps] = stage;
+  pipe->num_pumps++;
+
+  pthread_mutex_unlock (&pipe->lock);
+  return true;
+}
+
+bool
+pipeline_add_pump_mode (struct pipeline *pipe,
+                        void *(*routine)(void *data, void *product),
+                        void *data,
+                        enum pipeline_mode mode)
+{
+  struct pipeline_stage *stage;
+
+  assert (routine);
+
+  stage = pipeline_stage_new (pipe, data, mode);
+  stage->routine = routine;
+  return pipeline_add_stage (pipe, stage);
+}
+
+bool
+pipeline_add_batch_pump (struct pipeline *pipe,
+                         size_t (*routine)(void *data, void **products,
+                                           size_t count),
+                         void *data,
+                         enum pipeline_mode mode)
+{
+  struct pipeline_stage *stage;
+
+  assert (routine);
+
+  stage = pipeline_stage_new (pipe, data, mode);
+  stage->batch = routine;
+  return pipeline_add_stage (pipe, stage);
+}
+
+bool
+pipeline_add_filter (struct pipeline *pipe,
+                     bool (*routine)(void *data, void *product),
+                     void *data,
+                     enum pipeline_mode mode)
+{
+  struct pipeline_stage *stage;
+
+  assert (routine);
+
+  stage = pipeline_stage_new (pipe, data, mode);
+  stage->filter = routine;
+  return pipeline_add_stage (pipe, stage);
+}
+
+bool
+pipeline_add_fanout (struct pipeline *pipe,
+                     void (*routine)(void *data, void *product,
+                                     struct pipeline_emitter *emitter),
+                     void *data,
+                     enum pipeline_mode mode)
+{
+  struct pipeline_stage *stage;
+
+  assert (routine);
+
+  stage = pipeline_stage_new (pipe, data, mode);
+  stage->fanout = routine;
+  return pipeline_add_stage (pipe, stage);
+}
+
+/*
+ * Schedule a product's next stage on the pool which runs that stage.
+ */
+static void
+pipeline_dispatch (struct pipeline *pipe, struct pipeline_state *state)
+{
+  struct pipeline_stage *stage = pipeline_stage_at (pipe,
+                                                    state->current_stage);
+
+  thread_pool_push_work (stage->pool ? stage->pool : pipe->pool,
+                         &state->work);
+}
+
+/*
+ * Shut down the pipe's pool and every stage's worker group.
+ */
+static void
+pipeline_shutdown (struct pipeline *pipe)
+{
+  size_t i;
+
+  for (i = 0; i < pipe->num_pumps; i++)
+    if (pipe->pump[i]->pool)
+      thread_pool_terminate (pipe->pump[i]->pool);
+
+  thread_pool_terminate (pipe->pool);
+
+  /* wake anyone waiting to pull from the dried up pipe */
+  pthread_cond_broadcast (&pipe->pulled);
+}
+
+/*
+ * Account for a product leaving the pipe, resuming the inlet if it was parked
+ * and shutting the pool down once the pipe has dried up. ORIGIN is the
+ * fan-out which emitted the product, or NULL if it came from the inlet.
+ */
+static void
+pipeline_leave (struct pipeline *pipe, struct pipeline_stage *origin)
+{
+  struct link_queue ready;
+  bool done;
+
+  link_queue_init (&ready);
+
+  pthread_mutex_lock (&pipe->lock);
+
+  pipe->active_lines--;
+  if (origin)
+    origin->emitted--;
+  pipeline_unpark (pipe, &ready);
+  if (0 != pipe->stalled)
+    pthread_cond_broadcast (&pipe->room);
+  done = pipe->dry && 0 == pipe->active_lines;
+
+  pthread_mutex_unlock (&pipe->lock);
+
+  pipeline_resume (pipe, &ready);
+  if (done)
+    pipeline_shutdown (pipe);
+}
+
+/*
+ * Mark an inlet as dried up, and the pipe once they all have. Must be called
+ * with the lock held. Returns true if the pool should be shut down.
+ */
+static bool
+pipeline_dry_up (struct pipeline *pipe)
+{
+  if (0 < --pipe->live_inlets)
+    return false;
+
+  pipe->dry = true;
+  return 0 == pipe->active_lines;
+}
+
+/*
+ * Feed the auto-tuner a batch which is leaving the pipe. Once per interval
+ * it compares the outlet's throughput with the previous interval's and takes
+ * a step with one knob (alternating between the in-flight limit and, if
+ * enabled, the number of active workers): the same way again if throughput
+ * rose, the other way if it fell. While the mean time products spend in the
+ * pipe exceeds the latency bound both knobs only step down.
+ */
+static void
+pipeline_tune (struct pipeline *pipe, struct pipeline_state *state)
+{
+  struct pipeline_tuner *tuner = &pipe->tuner;
+  struct link_queue ready;
+  uint64_t now = pipeline_clock ();
+  size_t *value, max_value, step;
+  double rate;
+
+  link_queue_init (&ready);
+
+  pthread_mutex_lock (&pipe->lock);
+
+  if (0 == tuner->start)
+    tuner->start = now;
+  tuner->products += state->count;
+  tuner->latency += (now - state->entered_at) * state->count;
+
+  if (now - tuner->start < pipe->tune_interval || 0 == tuner->products)
+    {
+      pthread_mutex_unlock (&pipe->lock);
+      return;
+    }
+
+  rate = (double) tuner->products / (now - tuner->start);
+  if (0 != pipe->tune_max_latency
+      && pipe->tune_max_latency < tuner->latency / tuner->products)
+    tuner->step[0] = tuner->step[1] = -1;
+  else if (rate < tuner->last_rate)
+    tuner->step[tuner->knob] = -tuner->step[tuner->knob];
+
+  if (0 == tuner->knob)
+    {
+      value = &pipe->max_inflight;
+      max_value = PIPELINE_TUNE_MAX_INFLIGHT * pipe->max_threads;
+    }
+  else
+    {
+      value = &pipe->active_workers;
+      max_value = pipe->max_threads;
+    }
+
+  /* take steps of about an eighth so large limits move quickly enough */
+  step = *value / 8 ? *value / 8 : 1;
+  if (0 < tuner->step[tuner->knob])
+    *value = *value + step < max_value ? *value + step : max_value;
+  else
+    *value = step < *value ? *value - step : 1;
+
+  if (0 == tuner->knob)
+    pipeline_unpark (pipe, &ready);
+  else
+    thread_pool_set_active (pipe->pool, pipe->active_workers);
+
+  if (pipe->tune_workers)
+    tuner->knob = !tuner->knob;
+  tuner->last_rate = rate;
+  tuner->start = now;
+  tuner->products = 0;
+  tuner->latency = 0;
+
+  pthread_mutex_unlock (&pipe->lock);
+
+  pipeline_resume (pipe, &ready);
+}
+
+/*
+ * Record a run of STAGE which began at START. STATE is the product which has
+ * moved on from it to the stage it now waits for, or NULL if it left the
+ * pipe. STAGE is NULL for the inlet.
+ */
+static void
+pipeline_account (struct pipeline *pipe,
+                  struct pipeline_stage *stage,
+                  struct pipeline_state *state,
+                  uint64_t start)
+{
+  uint64_t end = pipeline_clock ();
+
+  if (stage)
+    {
+      __sync_fetch_and_add (&stage->stats.runs, 1);
+      __sync_fetch_and_add (&stage->stats.busy_nsec, end - start);
+      __sync_fetch_and_sub (&stage->stats.in_flight, 1);
+    }
+  else
+    {
+      __sync_fetch_and_add (&pipe->inlet_stats.runs, 1);
+      __sync_fetch_and_add (&pipe->inlet_stats.busy_nsec, end - start);
+    }
+
+  if (state)
+    {
+      state->ready_at = end;
+      __sync_fetch_and_add (&pipeline_stage_at (pipe,
+                                                state->current_stage)
+                                               ->stats.in_flight, 1);
+    }
+}
+
+/*
+ * Move an empty batch on to the next stage which has to see its sequence
+ * number: an in-order pump, a fan-out, or the ordered outlet. Returns false
+ * if there is none, in which case the batch can leave the pipe right away.
+ */
+static bool
+pipeline_skip (struct pipeline *pipe, struct pipeline_state *state)
+{
+  struct pipeline_stage *stage;
+
+  for (;; state->current_stage++)
+    {
+      stage = pipeline_stage_at (pipe, state->current_stage);
+      if (PIPELINE_SERIAL_IN_ORDER == stage->mode || stage->fanout)
+        return true;
+      if (stage == &pipe->outlet_stage)
+        return false;
+    }
+}
+
+/*
+ * Take STATE through the rest of the pipe on this thread, as far as it can
+ * go without waiting for a serial stage or a worker group.
+ */
+static void
+pipeline_drain (struct pipeline *pipe, struct pipeline_state *state)
+{
+  state->drain = true;
+  while (NULL != state)
+    state = pipeline_enter (pipe, state);
+}
+
+/*
+ * Hold the fan-out STAGE back while the pipe is over its in-flight limit,
+ * until products leave it. Products stuck behind a fan-out which is itself
+ * waiting may never leave, so it stops waiting once every product STAGE
+ * emitted has left: those only depend on stages further on, and the last
+ * fan-out's products on none that wait. A fan-out never waits if it would
+ * leave none of the pipe's workers free to move products on.
+ */
+static void
+pipeline_emit_wait (struct pipeline *pipe, struct pipeline_stage *stage)
+{
+  pthread_mutex_lock (&pipe->lock);
+  pipe->stalled++;
+  while (pipe->max_inflight < pipe->active_lines
+         && 0 != stage->emitted
+         && pipe->stalled < pipe->active_workers)
+    pthread_cond_wait (&pipe->room, &pipe->lock);
+  pipe->stalled--;
+  pthread_mutex_unlock (&pipe->lock);
+}
+
+/*
+ * Send off the batch EMITTER is filling, numbered in the fan-out's own
+ * sequence. The previous batch is dispatched and this one held back.
+ */
+static void
+pipeline_emit_flush (struct pipeline_emitter *emitter)
+{
+  struct pipeline *pipe = emitter->pipe;
+  struct pipeline_state *state = emitter->state;
+
+  if (NULL == state)
+    return;
+
+  state->seq = __sync_fetch_and_add (&emitter->stage->gate[state->lane]
+                                                    .next_seq, 1);
+  if (pipe->collect_stats)
+    {
+      state->ready_at = pipeline_clock ();
+      __sync_fetch_and_add (&pipeline_stage_at (pipe, state->current_stage)
+                                                ->stats.in_flight, 1);
+    }
+
+  if (emitter->last)
+    pipeline_dispatch (pipe, emitter->last);
+  emitter->last = state;
+  emitter->state = NULL;
+}
+
+bool
+pipeline_emit (struct pipeline_emitter *emitter, void *product)
+{
+  struct pipeline *pipe;
+  struct pipeline_state *state;
+
+  assert (emitter);
+  pipe = emitter->pipe;
+
+  if (NULL == emitter->state)
+    {
+      /* the last batch took the pipe over its limit: take the batch held
+       * back through the following stages here, as far as it goes, and
+       * wait for products to leave before starting another */
+      if (emitter->crowded)
+        {
+          if (emitter->last)
+            pipeline_drain (pipe, emitter->last);
+          emitter->last = NULL;
+          pipeline_emit_wait (pipe, emitter->stage);
+        }
+
+      state = pipeline_state_new (pipe, emitter->next_stage);
+      if (NULL == state)
+        return false;
+      state->lane = emitter->lane;
+      state->entered_at = emitter->entered_at;
+      state->origin = emitter->stage;
+      emitter->state = state;
+
+      /* new products count as in flight, but are never parked: the fan-out
+       * has to see its products through itself */
+      pthread_mutex_lock (&pipe->lock);
+      pipe->active_lines++;
+      emitter->stage->emitted++;
+      emitter->crowded = pipe->max_inflight < pipe->active_lines;
+      pthread_mutex_unlock (&pipe->lock);
+    }
+
+  emitter->state->products[emitter->state->count++] = product;
+  if (pipe->batch_size == emitter->state->count)
+    pipeline_emit_flush (emitter);
+  return true;
+}
+
+/*
+ * Run a fan-out STAGE on every product of a batch, which is then done with.
+ * Returns the last batch it emitted for the caller to carry on, if any.
+ */
+static struct pipeline_state *
+pipeline_fan_out (struct pipeline *pipe,
+                  struct pipeline_stage *stage,
+                  struct pipeline_state *state,
+                  uint64_t start)
+{
+  struct pipeline_emitter emitter;
+  struct pipeline_stage *origin;
+  size_t i;
+
+  emitter.pipe = pipe;
+  emitter.stage = stage;
+  emitter.next_stage = state->current_stage + 1;
+  emitter.lane = state->lane;
+  emitter.entered_at = state->entered_at;
+  emitter.state = NULL;
+  emitter.last = NULL;
+  emitter.crowded = false;
+
+  for (i = 0; i < state->count; i++)
+    stage->fanout (stage->gate[state->lane].data, state->products[i],
+                   &emitter);
+  pipeline_emit_flush (&emitter);
+
+  if (pipe->collect_stats)
+    pipeline_account (pipe, stage, NULL, start);
+
+  origin = state->origin;
+  pipeline_state_free (pipe, state);
+  pipeline_leave (pipe, origin);
+  return emitter.last;
+}
+
+/*
+ * Run STAGE on a product and move it on to the next stage. Returns the
+ * product's state, or NULL if it left the pipe at the outlet.
+ */
+static struct pipeline_state *
+pipeline_run (struct pipeline *pipe,
+              struct pipeline_stage *stage,
+              struct pipeline_state *state)
+{
+  void *data = stage->gate[state->lane].data;
+  struct pipeline_stage *origin;
+  uint64_t start = 0;
+  size_t i;
+
+  if (pipe->collect_stats)
+    {
+      start = pipeline_clock ();
+      __sync_fetch_and_add (&stage->stats.wait_nsec, start - state->ready_at);
+    }
+
+  if (stage == &pipe->outlet_stage && pipe->pull)
+    {
+      if (0 != pipe->tune_interval)
+        pipeline_tune (pipe, state);
+      if (pipe->collect_stats)
+        pipeline_account (pipe, stage, NULL, start);
+
+      origin = state->origin;
+      pthread_mutex_lock (&pipe->lock);
+      if (0 != state->count)
+        {
+          link_queue_push (&pipe->outbox, &state->link);
+          pipe->ready += state->count;
+          state = NULL;
+        }
+      pthread_mutex_unlock (&pipe->lock);
+      pthread_cond_broadcast (&pipe->pulled);
+
+      if (state)
+        pipeline_state_free (pipe, state);
+      pipeline_leave (pipe, origin);
+      return NULL;
+    }
+
+  if (stage == &pipe->outlet_stage)
+    {
+      if (NULL == pipe->batch_outlet)
+        for (i = 0; i < state->count; i++)
+          pipe->outlet (pipe->outlet_data, state->products[i]);
+      else if (0 != state->count)
+        pipe->batch_outlet (pipe->outlet_data, state->products, state->count);
+
+      if (0 != pipe->tune_interval)
+        pipeline_tune (pipe, state);
+
+      if (pipe->product_cache)
+        for (i = 0; i < state->count; i++)
+          cache_free (pipe->product_cache, state->products[i]);
+
+      if (pipe->collect_stats)
+        pipeline_account (pipe, stage, NULL, start);
+
+      origin = state->origin;
+      pipeline_state_free (pipe, state);
+      pipeline_leave (pipe, origin);
+      return NULL;
+    }
+
+  if (stage->fanout)
+    return pipeline_fan_out (pipe, stage, state, start);
+
+  if (stage->filter)
+    {
+      size_t kept = 0;
+
+      for (i = 0; i < state->count; i++)
+        if (stage->filter (data, state->products[i]))
+          state->products[kept++] = state->products[i];
+      state->count = kept;
+    }
+  else if (stage->routine)
+    for (i = 0; i < state->count; i++)
+      state->products[i] = stage->routine (data, state->products[i]);
+  else if (0 != state->count)
+    {
+      i = stage->batch (data, state->products, state->count);
+      assert (i <= state->count);
+      state->count = i;
+    }
+
+  state->current_stage++;
+
+  /* with every product dropped there is nothing left to run, but ordered
+   * stages further on may still be waiting for its sequence number */
+  if (0 == state->count && !pipeline_skip (pipe, state))
+    {
+      if (pipe->collect_stats)
+        pipeline_account (pipe, stage, NULL, start);
+      origin = state->origin;
+      pipeline_state_free (pipe, state);
+      pipeline_leave (pipe, origin);
+      return NULL;
+    }
+
+  if (pipe->collect_stats)
+    pipeline_account (pipe, stage, state, start);
+  return state;
+}
+
+/*
+ * Decide who runs the next stage of a product which has just finished stage
+ * FROM (NULL for the inlet). Unfused pipes hand it to the pool for its next
+ * stage. Fused pipes, and products being drained by a fan-out, keep it on
+ * this thread, so it is returned to the caller to carry on with, unless
+ * either stage has a worker group of its own.
+ */
+static struct pipeline_state *
+pipeline_continue (struct pipeline *pipe,
+                   struct pipeline_stage *from,
+                   struct pipeline_state *state)
+{
+  if (NULL == state)
+    return NULL;
+
+  if ((pipe->fused || state->drain)
+      && (NULL == from || NULL == from->pool)
+      && NULL == pipeline_stage_at (pipe, state->current_stage)->pool)
+    return state;
+
+  pipeline_dispatch (pipe, state);
+  return NULL;
+}
+
+/*
+ * Pass a product through the stage it has reached. Parallel stages simply run
+ * it. Serial stages queue it; whichever thread finds the stage idle takes it
+ * over and runs every product that is (or becomes) ready, so the routine
+ * never runs concurrently with itself and never needs its own locking.
+ * Products run while holding a serial stage are handed off to the pool,
+ * except for the last one which (when fused) this thread carries on with.
+ * Returns the product this thread should carry on with, if any.
+ */
+static struct pipeline_state *
+pipeline_enter (struct pipeline *pipe, struct pipeline_state *state)
+{
+  struct pipeline_stage *stage = pipeline_stage_at (pipe,
+                                                    state->current_stage);
+  struct pipeline_gate *gate = &stage->gate[state->lane];
+  struct pipeline_state *next;
+
+  if (PIPELINE_PARALLEL == stage->mode)
+    return pipeline_continue (pipe, stage, pipeline_run (pipe, stage, state));
+
+  pthread_mutex_lock (&gate->lock);
+
+  if (PIPELINE_SERIAL_IN_ORDER == stage->mode)
+    pipeline_order_insert (pipe, &gate->order, state);
+  else
+    link_queue_push (&gate->pending, &state->link);
+
+  if (gate->busy)
+    {
+      pthread_mutex_unlock (&gate->lock);
+      return NULL;
+    }
+
+  gate->busy = true;
+  state = NULL;
+  for (;;)
+    {
+      if (PIPELINE_SERIAL_IN_ORDER == stage->mode)
+        next = pipeline_order_take (&gate->order);
+      else
+        {
+          struct loomlib_link *link = link_queue_pop (&gate->pending);
+          next = link ? LOOMLIB_CONTAINER_OF (link, struct pipeline_state,
+                                              link)
+                      : NULL;
+        }
+
+      if (NULL == next)
+        break;
+
+      /* another product is ready, so the previous one has to go */
+      if (state)
+        pipeline_dispatch (pipe, state);
+
+      pthread_mutex_unlock (&gate->lock);
+      state = pipeline_run (pipe, stage, next);
+      pthread_mutex_lock (&gate->lock);
+    }
+  gate->busy = false;
+
+  pthread_mutex_unlock (&gate->lock);
+
+  return pipeline_continue (pipe, stage, state);
+}
+
+static unsigned long
+pipeline_elapsed_usec (const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000UL
+         + now.tv_nsec / 1000 - start->tv_nsec / 1000;
+}
+
+/*
+ * Fill STATE with a batch of products from PARTITION of the inlet. Returns
+ * false if the inlet dried up, in which case STATE holds whatever it gave
+ * before that.
+ */
+static bool
+pipeline_fill (struct pipeline *pipe,
+               struct pipeline_state *state,
+               size_t partition)
+{
+  struct timespec start;
+  void *product;
+
+  if (pipe->batch_inlet)
+    {
+      state->count = pipe->batch_inlet (pipe->inlet_data, state->products,
+                                        pipe->batch_size);
+      assert (state->count <= pipe->batch_size);
+      return 0 != state->count;
+    }
+
+  if (0 != pipe->flush_usec)
+    clock_gettime (CLOCK_MONOTONIC, &start);
+
+  while (state->count < pipe->batch_size)
+    {
+      if (pipe->partitioned_inlet)
+        product = pipe->partitioned_inlet (pipe->inlet_data, partition);
+      else
+        product = pipe->inlet (pipe->inlet_data);
+
+      if (NULL == product)
+        return false;
+      state->products[state->count++] = product;
+
+      /* send a partial batch on rather than hold it back indefinitely */
+      if (0 != pipe->flush_usec
+          && state->count < pipe->batch_size
+          && pipe->flush_usec <= pipeline_elapsed_usec (&start))
+        break;
+    }
+
+  return true;
+}
+
+/*
+ * Run the inlet once, sending its batch into the pipe and rescheduling
+ * itself, unless the pipe is full. Returns the new batch if this thread
+ * should carry it on (when fused).
+ */
+static struct pipeline_state *
+pipeline_inlet (struct pipeline *pipe, struct pipeline_state *state)
+{
+  struct pipeline_state *new_state;
+  uint64_t start = 0;
+  bool more;
+  bool done;
+
+  pthread_mutex_lock (&pipe->lock);
+  if (pipe->terminated)
+    {
+      done = pipeline_dry_up (pipe);
+      pthread_mutex_unlock (&pipe->lock);
+      pipeline_state_free (pipe, state);
+      if (done)
+        pipeline_shutdown (pipe);
+      return NULL;
+    }
+
+  /* too much product in the pipe (or, when pulled, nothing wanted): park
+   * the inlet until some leaves */
+  if (0 == pipeline_room (pipe))
+    {
+      if (pipe->collect_stats)
+        state->ready_at = pipeline_clock ();
+      link_queue_push (&pipe->parked, &state->link);
+      pthread_mutex_unlock (&pipe->lock);
+      return NULL;
+    }
+  pipe->active_lines++;
+  pthread_mutex_unlock (&pipe->lock);
+
+  new_state = pipeline_state_new (pipe, 0);
+  assert (new_state);
+  if (pipe->collect_stats)
+    start = pipeline_clock ();
+  more = pipeline_fill (pipe, new_state, state->partition);
+  if (0 != pipe->tune_interval)
+    new_state->entered_at = pipeline_clock ();
+  if (pipe->collect_stats)
+    pipeline_account (pipe, NULL, 0 != new_state->count ? new_state : NULL,
+                      start);
+
+  /* if it has dried up then clean up resources */
+  if (0 == new_state->count)
+    {
+      pipeline_state_free (pipe, new_state);
+      pipeline_state_free (pipe, state);
+      pthread_mutex_lock (&pipe->lock);
+      pipe->active_lines--;
+      done = pipeline_dry_up (pipe);
+      pthread_mutex_unlock (&pipe->lock);
+      if (done)
+        pipeline_shutdown (pipe);
+      return NULL;
+    }
+
+  /* otherwise send the batch on and restart this inlet stage (unless it dried
+   * up part way through the batch); the batch is numbered first since the
+   * next inlet call may start as soon as this one is rescheduled, and other
+   * partitions may be numbering theirs at the same time */
+  if (pipe->key)
+    new_state->lane = pipe->key (pipe->key_data, new_state->products[0])
+                      % pipe->num_lanes;
+  new_state->seq = __sync_fetch_and_add (&pipe->next_seq[new_state->lane],
+                                         1);
+
+  if (more)
+    thread_pool_push_work (pipe->pool, &state->work);
+  else
+    {
+      pipeline_state_free (pipe, state);
+      pthread_mutex_lock (&pipe->lock);
+      pipeline_dry_up (pipe);
+      pthread_mutex_unlock (&pipe->lock);
+    }
+
+  return pipeline_continue (pipe, NULL, new_state);
+}
+
+static void
+pipeline_loop (void *data)
+{
+  struct pipeline_state *state = data;
+  struct pipeline *pipe = state->pipe;
+
+  /* inject product from the inlet into the pipe */
+  if (state->current_stage < 0)
+    state = pipeline_inlet (pipe, state);
+
+  /* pump product through the pipe, or deposit it at the outlet */
+  while (NULL != state)
+    state = pipeline_enter (pipe, state);
+}
+
+/*
+ * Check that every in-order stage sees products in the order they left the
+ * inlet. A fan-out which is not itself in order numbers the products it
+ * emits in whatever order its parents reached it, so no stage after it can
+ * restore the inlet's order.
+ */
+static bool
+pipeline_check_order (struct pipeline *pipe)
+{
+  struct pipeline_stage *stage;
+  bool unordered = false;
+  size_t i;
+
+  for (i = 0; i <= pipe->num_pumps; i++)
+    {
+      stage = pipeline_stage_at (pipe, i);
+      if (unordered && PIPELINE_SERIAL_IN_ORDER == stage->mode)
+        return false;
+      if (stage->fanout && PIPELINE_SERIAL_IN_ORDER != stage->mode)
+        unordered = true;
+    }
+
+  return true;
+}
+
+bool
+pipeline_execute (struct pipeline *pipe)
+{
+  struct pipeline_state *state;
+  size_t max_inflight;
+  size_t i;
+
+  assert (pipe);
+  assert (pipe->pool);
+  assert (pipe->inlet || pipe->batch_inlet || pipe->partitioned_inlet);
+  assert (pipe->outlet || pipe->batch_outlet || pipe->pull);
+  assert (!pipe->state_cache);
+  assert (1 == pipe->num_lanes || 1 == pipe->batch_size);
+
+  if (!pipeline_check_order (pipe))
+    return false;
+
+  /* enough for every product in flight, as far as autotuning may raise the
+   * limit, and every inlet with the product it is filling; any beyond that
+   * (if the limit is raised by hand) are simply freed */
+  max_inflight = pipe->max_inflight;
+  if (0 != pipe->tune_interval
+      && max_inflight < PIPELINE_TUNE_MAX_INFLIGHT * pipe->max_threads)
+    max_inflight = PIPELINE_TUNE_MAX_INFLIGHT * pipe->max_threads;
+  pipe->state_cache = cache_init (max_inflight + 2 * pipe->num_inlets,
+                                  sizeof *state
+                                  + pipe->batch_size * sizeof *state->products,
+                                  malloc, free);
+  assert (pipe->state_cache);
+
+  /* start every inlet */
+  pipe->live_inlets = pipe->num_inlets;
+  for (i = 0; i < pipe->num_inlets; i++)
+    {
+      state = pipeline_state_new (pipe, -1);
+      assert (state);
+      state->partition = i;
+      if (!thread_pool_push_work (pipe->pool, &state->work))
+        return false;
+    }
+
+  return true;
+}
+
+void *
+pipeline_next (struct pipeline *pipe)
+{
+  struct pipeline_state *state;
+  struct link_queue ready;
+  struct loomlib_link *link;
+  void *product = NULL;
+
+  assert (pipe);
+  assert (pipe->pull);
+  assert (pipe->state_cache);
+
+  link_queue_init (&ready);
+
+  pthread_mutex_lock (&pipe->lock);
+
+  pipe->waiting++;
+  for (;;)
+    {
+      if (0 != pipe->ready)
+        {
+          link = pipe->outbox.head;
+          state = LOOMLIB_CONTAINER_OF (link, struct pipeline_state, link);
+          product = state->products[pipe->taken++];
+          pipe->ready--;
+
+          if (state->count == pipe->taken)
+            {
+              link_queue_pop (&pipe->outbox);
+              pipe->taken = 0;
+              pipeline_state_free (pipe, state);
+            }
+          break;
+        }
+
+      if (pipe->dry && 0 == pipe->active_lines)
+        break;
+
+      /* ask for another product, unless enough are on their way */
+      pipeline_unpark (pipe, &ready);
+      if (0 != link_queue_count (&ready))
+        {
+          pthread_mutex_unlock (&pipe->lock);
+          pipeline_resume (pipe, &ready);
+          pthread_mutex_lock (&pipe->lock);
+          continue;
+        }
+
+      pthread_cond_wait (&pipe->pulled, &pipe->lock);
+    }
+  pipe->waiting--;
+
+  pthread_mutex_unlock (&pipe->lock);
+  return product;
 }
@@ -22,59 +22,148 @@
 
 #define _GNU_SOURCE
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 
+#include "async_link_queue.h"
 #include "async_queue.h"
 #include "barrier.h"
 #include "thread_pool.h"
 
+/*
+ * A work unit allocated by THREAD_POOL_PUSH. Its WORK runs
+ * WORK_UNIT_TRAMPOLINE, which frees the unit before calling FUNC.
+ */
 struct work_unit
 {
+  struct thread_pool_work work;
   void (*func)(void *data);
   void *data;
 };
 
 struct thread_pool
 {
-  struct async_queue *work_queue;
+  struct async_link_queue *work_queue;
   struct async_queue *thread_queue;
+  struct thread_pool_work term;
+  bool terminated;
 
   size_t num_threads;
+
+  /* at most MAX_ACTIVE threads take work; the other threads wait on
+   * STANDBY. AWAKE is the number of threads not on standby. Both change
+   * under LOCK but are read without it, so those accesses are atomic. */
+  size_t max_active;
+  size_t awake;
+  pthread_cond_t standby;
+
   pthread_mutex_t lock;
 };
 
+/* the pool the calling thread works for, if any */
+static __thread struct thread_pool *thread_pool_self;
+
 static void THREAD_POOL_TERM_SIG (void *data) { data = data; }
 
+/*
+ * Queue WORK. Workers pushing to their own pool ignore its bound: if every
+ * worker blocked waiting for room nobody would be left to make any.
+ */
+static bool
+thread_pool_queue (struct thread_pool *pool, struct thread_pool_work *work)
+{
+  if (thread_pool_self == pool)
+    async_link_queue_force_push (pool->work_queue, &work->link);
+  else
+    async_link_queue_push (pool->work_queue, &work->link);
+  return true;
+}
+
+static void
+work_unit_trampoline (void *data)
+{
+  struct work_unit *unit = data;
+  void (*func)(void *data) = unit->func;
+  void *func_data = unit->data;
+
+  free (unit);
+  func (func_data);
+}
+
+static struct work_unit *
+work_unit_new (void(*func)(void *data), void *data)
+{
+  struct work_unit *unit = malloc (sizeof *unit);
+
+  if (NULL == unit)
+    return NULL;
+
+  unit->work.func = work_unit_trampoline;
+  unit->work.data = unit;
+  unit->func = func;
+  unit->data = data;
+  return unit;
+}
+
+/*
+ * Put the calling thread on standby while too many threads are active.
+ */
+static void
+thread_standby (struct thread_pool *pool)
+{
+  pthread_mutex_lock (&pool->lock);
+  while (pool->max_active < pool->awake)
+    {
+      __atomic_sub_fetch (&pool->awake, 1, __ATOMIC_RELAXED);
+      pthread_cond_wait (&pool->standby, &pool->lock);
+      __atomic_add_fetch (&pool->awake, 1, __ATOMIC_RELAXED);
+    }
+  pthread_mutex_unlock (&pool->lock);
+}
+
 static void *
 thread_loop (void *args)
 {
   struct thread_pool *pool = args;
-  struct work_unit *work;
+  struct thread_pool_work *work;
+  struct loomlib_link *link;
+
+  thread_pool_self = pool;
 
-  while (NULL != (work = async_queue_pop (pool->work_queue, true)))
+  for (;;)
     {
+      if (__atomic_load_n (&pool->max_active, __ATOMIC_RELAXED)
+          < __atomic_load_n (&pool->awake, __ATOMIC_RELAXED))
+        thread_standby (pool);
+
+      if (NULL == (link = async_link_queue_pop (pool->work_queue, true)))
+        break;
+      work = LOOMLIB_CONTAINER_OF (link, struct thread_pool_work, link);
+
       if (THREAD_POOL_TERM_SIG == work->func)
         {
           pthread_mutex_lock (&pool->lock);
 
           if (1 < pool->num_threads)
-            thread_pool_push (pool, THREAD_POOL_TERM_SIG, NULL);
+            thread_pool_push_work (pool, &pool->term);
 
           pool->num_threads--;
+          __atomic_sub_fetch (&pool->awake, 1, __ATOMIC_RELAXED);
 
           pthread_mutex_unlock (&pool->lock);
-          free (work);
 
           return NULL;
         }
 
       work->func (work->data);
-
-      free (work);
     }
 
   return NULL;
@@ -83,19 +172,98 @@ thread_loop (void *args)
 struct thread_pool *
 thread_pool_new (size_t max_threads)
 {
-  struct thread_pool *pool = malloc (sizeof *pool);
-  pool->work_queue = async_queue_new(),
+  return thread_pool_new_bounded (max_threads, 0);
+}
+
+struct thread_pool *
+thread_pool_new_bounded (size_t max_threads, size_t max_queued)
+{
+  return thread_pool_new_pinned (max_threads, max_queued, NULL);
+}
+
+struct thread_pool *
+thread_pool_new_pinned (size_t max_threads, size_t max_queued,
+                        const int *cpus)
+{
+  struct thread_pool *pool;
+  size_t i;
+
+#ifdef HAVE_PTHREAD_ATTR_SETAFFINITY_NP
+  /* a core a cpu_set_t cannot name is a caller error, not one to skip */
+  for (i = 0; NULL != cpus && i < max_threads; i++)
+    if (CPU_SETSIZE <= cpus[i])
+      return NULL;
+#endif
+
+  pool = malloc (sizeof *pool);
+  if (NULL == pool)
+    return NULL;
+
+  pool->work_queue = async_link_queue_new_bounded (max_queued),
   pool->thread_queue = async_queue_new();
-  pool->num_threads = max_threads;
+  pool->term.func = THREAD_POOL_TERM_SIG;
+  pool->term.data = NULL;
+  pool->terminated = false;
+  pool->num_threads = 0;
+  pool->max_active = max_threads;
+  pool->awake = 0;
+  pthread_cond_init (&pool->standby, NULL);
   pthread_mutex_init (&pool->lock, NULL);
 
-  while (max_threads--)
+  for (i = 0; i < max_threads; i++)
     {
       pthread_t *thread = malloc (sizeof *thread);
-      pthread_create (thread, NULL, thread_loop, pool);
+      pthread_attr_t attr;
+      int rv;
+
+      if (NULL == thread)
+        break;
+
+      pthread_attr_init (&attr);
+#ifdef HAVE_PTHREAD_ATTR_SETAFFINITY_NP
+      if (NULL != cpus && 0 <= cpus[i])
+        {
+          cpu_set_t set;
+
+          CPU_ZERO (&set);
+          CPU_SET (cpus[i], &set);
+          pthread_attr_setaffinity_np (&attr, sizeof set, &set);
+        }
+#endif
+
+      /* the counts must be right before the thread can exit again */
+      pthread_mutex_lock (&pool->lock);
+      pool->num_threads++;
+      __atomic_add_fetch (&pool->awake, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock (&pool->lock);
+
+      /* a core we may not run on is not worth losing the thread over */
+      rv = pthread_create (thread, &attr, thread_loop, pool);
+      if (0 != rv)
+        rv = pthread_create (thread, NULL, thread_loop, pool);
+      pthread_attr_destroy (&attr);
+
+      if (0 != rv)
+        {
+          pthread_mutex_lock (&pool->lock);
+          pool->num_threads--;
+          __atomic_sub_fetch (&pool->awake, 1, __ATOMIC_RELAXED);
+          pthread_mutex_unlock (&pool->lock);
+          free (thread);
+          break;
+        }
       async_queue_push (pool->thread_queue, thread);
     }
 
+  /* not every thread could be started: shut down the ones that were */
+  if (i < max_threads)
+    {
+      if (0 < i)
+        thread_pool_terminate (pool);
+      thread_pool_free (pool);
+      return NULL;
+    }
+
   return pool;
 }
 
@@ -109,12 +277,13 @@ thread_pool_free (struct thread_pool *pool)
       free (thread);
     }
 
-  assert (0 == async_queue_count (pool->work_queue));
-  async_queue_free (pool->work_queue);
+  assert (0 == async_link_queue_count (pool->work_queue));
+  async_link_queue_free (pool->work_queue);
   
   assert (0 == async_queue_count (pool->thread_queue));
   async_queue_free (pool->thread_queue);
 
+  pthread_cond_destroy (&pool->standby);
   pthread_mutex_destroy (&pool->lock);
   free (pool);
 }
@@ -124,17 +293,77 @@ thread_pool_push (struct thread_pool *pool,
                   void(*func)(void *data),
                   void *data)
 {
-  struct work_unit *work = malloc (sizeof *work);
-  work->func = func,
-  work->data = data;
+  struct work_unit *unit = work_unit_new (func, data);
+
+  if (NULL == unit)
+    return false;
+
+  if (thread_pool_queue (pool, &unit->work))
+    return true;
+
+  free (unit);
+  return false;
+}
+
+bool
+thread_pool_push_work (struct thread_pool *pool,
+                       struct thread_pool_work *work)
+{
+  assert (work);
+  assert (work->func);
 
-  return async_queue_push (pool->work_queue, work);
+  return thread_pool_queue (pool, work);
+}
+
+bool
+thread_pool_try_push (struct thread_pool *pool,
+                      void(*func)(void *data),
+                      void *data)
+{
+  struct work_unit *unit = work_unit_new (func, data);
+
+  if (NULL == unit)
+    return false;
+
+  if (async_link_queue_try_push (pool->work_queue, &unit->work.link))
+    return true;
+
+  free (unit);
+  return false;
+}
+
+bool
+thread_pool_set_active (struct thread_pool *pool, size_t max_active)
+{
+  assert (pool);
+
+  if (0 == max_active)
+    return false;
+
+  pthread_mutex_lock (&pool->lock);
+  __atomic_store_n (&pool->max_active, max_active, __ATOMIC_RELAXED);
+  pthread_cond_broadcast (&pool->standby);
+  pthread_mutex_unlock (&pool->lock);
+  return true;
 }
 
 bool
 thread_pool_terminate (struct thread_pool *pool)
 {
-  return thread_pool_push (pool, THREAD_POOL_TERM_SIG, NULL);
+  bool terminated;
+
+  /* every thread has to see the signal to exit */
+  pthread_mutex_lock (&pool->lock);
+  terminated = pool->terminated;
+  pool->terminated = true;
+  __atomic_store_n (&pool->max_active, (size_t) -1, __ATOMIC_RELAXED);
+  pthread_cond_broadcast (&pool->standby);
+  pthread_mutex_unlock (&pool->lock);
+
+  /* the signal is a single work unit, which can only be queued once */
+  if (terminated)
+    return true;
+  return thread_pool_push_work (pool, &pool->term);
 }
 
 static void
@@ -23,8 +23,11 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "async_list.h"
 #include "thread_pool.h"
@@ -35,24 +38,161 @@ struct tree
   struct vertice *root;
   struct thread_pool *pool;
   size_t max_threads;
+
+  /* admission control: at most MAX_INFLIGHT root iterations are executing.
+   * When the limit is reached the root task is parked in PARKED and only
+   * rescheduled once an iteration finishes. */
+  size_t max_inflight;
   size_t active_lines;
+  struct tree_state *parked;
+  uint64_t next_line;
+
+  /* with TREE_SCHEDULE_DEPTH_FIRST ready states wait in READY, a heap kept
+   * under READY_LOCK, and the pool only gets a token for each of them which
+   * runs whichever state is first in line when it is picked up. Tokens are
+   * recycled through the list TOKENS. */
+  enum tree_schedule schedule;
+  struct tree_state **ready;
+  size_t num_ready;
+  size_t max_ready;
+  struct tree_token *tokens;
+  pthread_mutex_t ready_lock;
+
+  /* the vertices reachable from the root, and the joins among them, which
+   * every iteration keeps NUM_JOIN_INPUTS inputs for between them. MEMOS
+   * are the memoized ones, whose memos the tree drops when it is freed. */
+  struct vertice **vertices;
+  size_t num_vertices;
+  struct vertice **joins;
+  size_t num_joins;
+  size_t num_join_inputs;
+  struct vertice **memos;
+  size_t num_memos;
+
+  /* when PROFILE is set every vertice keeps statistics, and the tree adds up
+   * the run time (WORK_NSEC) and critical path length (SPAN_NSEC) of every
+   * finished iteration */
+  bool profile;
+  uint64_t iterations;
+  uint64_t work_nsec;
+  uint64_t span_nsec;
+  uint64_t max_span_nsec;
+
+  /* bumped by every TREE_INVALIDATE, to visit each vertice once */
+  uint64_t invalidations;
+
+  /* set once the root will not be executed again */
+  bool root_done;
   bool terminated;
   pthread_mutex_t lock;
 };
 
+/*
+ * A work unit standing for one state on the ready heap, see TREE_PUSH. It
+ * cannot be embedded in the state it was pushed for, since another token may
+ * run (and free) that state while this one is still queued.
+ */
+struct tree_token
+{
+  struct thread_pool_work work;
+  struct tree *tree;
+  struct tree_token *next;
+};
+
 struct vertice
 {
+  /* CHILDREN is built up by TREE_ADD_CHILD and frozen by TREE_EXECUTE into
+   * the plain array CHILD, which is only read while the tree runs */
   struct async_list *children;
+  struct vertice **child;
+  size_t num_children;
+
   void *(*routine)(void *data, void *product);
+  void *(*join)(void *data, void **products, size_t num_products);
+  void (*release)(void *data, void *product);
   void *data;
+
+  /* the vertices this is a child of, in the order it was added to them */
+  struct vertice **parents;
+  size_t num_parents;
+
+  /* set by TREE_EXECUTE once it has seen this vertice: the tree it belongs
+   * to and, for a join, its index among the tree's joins */
+  struct tree *tree;
+  size_t join_index;
+
+  /* kept when the tree is profiled; CRITICAL_PARENT is the parent on the
+   * longest path which reaches this vertice */
+  struct tree_vertice_stats stats;
+  struct vertice *critical_parent;
+
+  /* memoization, see TREE_SET_MEMO: while MEMO_VALID is set, MEMO_PRODUCT is
+   * what the vertice returned for an input whose key was MEMO_KEY. If the
+   * vertice has a release routine MEMO_HOLDER holds a reference to it.
+   * GENERATION counts the invalidations, so that runs which started before
+   * one do not store their (stale) result. */
+  uint64_t (*key)(void *data, void *product);
+  bool memo_valid;
+  uint64_t memo_key;
+  void *memo_product;
+  struct tree_state *memo_holder;
+  uint64_t generation;
+  uint64_t invalidated;
+
   pthread_mutex_t lock;
 };
 
+/*
+ * The inputs a join vertice has received in one iteration, and the states
+ * holding them (see TREE_STATE). PENDING counts the parents which have yet
+ * to deliver theirs.
+ */
+struct tree_join
+{
+  size_t pending;
+  void **inputs;
+  struct tree_state **from;
+  uint64_t *path;
+};
+
+/*
+ * One root iteration. PENDING counts the tree_states of this iteration that
+ * have not finished yet. JOIN holds the iteration's inputs for each of the
+ * tree's joins. SPAN is the length of its critical path so far (profiled
+ * trees only). SEQ numbers the iterations in the order they started.
+ */
+struct tree_line
+{
+  size_t pending;
+  uint64_t seq;
+  uint64_t span;
+  struct tree_join join[];
+};
+
+/*
+ * A vertice to run on PRODUCT, which it was handed by the state FROM.
+ * When a vertice with a release routine returns a product for its children
+ * its state is kept as the product's holder: REFS counts the children (plus
+ * the parent while it hands the product out) which still use it.
+ */
 struct tree_state
 {
+  struct thread_pool_work work;
   struct tree *tree;
   struct vertice *vertice;
+  struct tree_line *line;
   void *product;
+  struct tree_state *from;
+  size_t refs;
+
+  /* how far the vertice is from the root, along the path that reached it */
+  size_t depth;
+
+  /* for profiling: when the state was queued, and the longest path of runs
+   * (through CRIT_FROM) in its iteration that led to it */
+  uint64_t queued_at;
+  uint64_t path;
+  struct vertice *crit_from;
 };
 
 struct tree *
@@ -71,17 +211,45 @@ tree_new (size_t max_threads)
     }
 
   tree->max_threads = max_threads;
+  tree->max_inflight = max_threads + 1;
   pthread_mutex_init (&tree->lock, NULL);
+  pthread_mutex_init (&tree->ready_lock, NULL);
   return tree;
 }
 
+static struct tree_state *
+tree_forget (struct vertice *vertice);
+
+static void
+tree_unref (struct tree_state *holder);
+
 void
 tree_free (struct tree *tree)
 {
+  size_t i;
+
   assert (tree);
   assert (tree->pool);
-  pthread_mutex_destroy (&tree->lock);
   thread_pool_free (tree->pool);
+
+  /* the memos hold the last references to their products; no other
+   * vertice is touched, so those may already have been freed */
+  for (i = 0; i < tree->num_memos; i++)
+    tree_unref (tree_forget (tree->memos[i]));
+
+  pthread_mutex_destroy (&tree->lock);
+  while (tree->tokens)
+    {
+      struct tree_token *token = tree->tokens;
+
+      tree->tokens = token->next;
+      free (token);
+    }
+  pthread_mutex_destroy (&tree->ready_lock);
+  free (tree->ready);
+  free (tree->vertices);
+  free (tree->joins);
+  free (tree->memos);
   free (tree);
 }
 
@@ -96,6 +264,122 @@ tree_terminate (struct tree *tree)
   return true;
 }
 
+static void
+tree_push (struct tree *tree, struct tree_state *state);
+
+bool
+tree_set_max_inflight (struct tree *tree, size_t max_inflight)
+{
+  struct tree_state *resume = NULL;
+
+  if (!tree || 0 == max_inflight)
+    return false;
+
+  pthread_mutex_lock (&tree->lock);
+  tree->max_inflight = max_inflight;
+  if (tree->parked && tree->active_lines < tree->max_inflight)
+    {
+      resume = tree->parked;
+      tree->parked = NULL;
+    }
+  pthread_mutex_unlock (&tree->lock);
+
+  if (resume)
+    tree_push (tree, resume);
+  return true;
+}
+
+bool
+tree_set_schedule (struct tree *tree, enum tree_schedule schedule)
+{
+  if (!tree)
+    return false;
+  pthread_mutex_lock (&tree->lock);
+  tree->schedule = schedule;
+  pthread_mutex_unlock (&tree->lock);
+  return true;
+}
+
+/*
+ * The time in nanoseconds, for profiling.
+ */
+static uint64_t
+tree_clock (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+bool
+tree_set_profile (struct tree *tree, bool enabled)
+{
+  if (!tree)
+    return false;
+  pthread_mutex_lock (&tree->lock);
+  tree->profile = enabled;
+  pthread_mutex_unlock (&tree->lock);
+  return true;
+}
+
+bool
+tree_get_stats (struct tree *tree, struct tree_stats *stats)
+{
+  if (!tree || !stats || !tree->profile)
+    return false;
+
+  pthread_mutex_lock (&tree->lock);
+  stats->iterations = tree->iterations;
+  stats->work_nsec = tree->work_nsec;
+  stats->span_nsec = tree->span_nsec;
+  stats->max_span_nsec = tree->max_span_nsec;
+  pthread_mutex_unlock (&tree->lock);
+
+  stats->parallelism = stats->span_nsec
+                       ? (double) stats->work_nsec / stats->span_nsec : 0;
+  return true;
+}
+
+bool
+tree_get_vertice_stats (struct vertice *vertice,
+                        struct tree_vertice_stats *stats)
+{
+  if (!vertice || !stats)
+    return false;
+  pthread_mutex_lock (&vertice->lock);
+  *stats = vertice->stats;
+  pthread_mutex_unlock (&vertice->lock);
+  return true;
+}
+
+size_t
+tree_get_critical_path (struct tree *tree, struct vertice **path,
+                        size_t max_path)
+{
+  struct vertice *end = NULL, *vertice;
+  size_t i, length = 0;
+
+  if (!tree || !tree->profile)
+    return 0;
+
+  /* the path ends at whichever vertice the longest path reaches */
+  for (i = 0; i < tree->num_vertices; i++)
+    if (!end || end->stats.path_nsec < tree->vertices[i]->stats.path_nsec)
+      end = tree->vertices[i];
+
+  for (vertice = end; vertice; vertice = vertice->critical_parent)
+    length++;
+
+  /* fill in PATH from the root, leaving out whatever does not fit */
+  i = length;
+  for (vertice = end; vertice; vertice = vertice->critical_parent)
+    if (--i < max_path)
+      path[i] = vertice;
+
+  return length;
+}
+
 struct vertice *
 tree_new_vertice (void *(*routine)(void *data, void *product),
                   void *data)
@@ -109,12 +393,127 @@ tree_new_vertice (void *(*routine)(void *data, void *product),
   return vertice;
 }
 
+struct vertice *
+tree_new_join_vertice (void *(*routine)(void *data, void **products,
+                                        size_t num_products),
+                       void *data)
+{
+  struct vertice *vertice = calloc (1, sizeof *vertice);
+  if (!vertice)
+    return NULL;
+  vertice->join = routine;
+  vertice->data = data;
+  pthread_mutex_init (&vertice->lock, NULL);
+  return vertice;
+}
+
+bool
+tree_set_release (struct vertice *vertice,
+                  void (*release)(void *data, void *product))
+{
+  if (!vertice)
+    return false;
+  pthread_mutex_lock (&vertice->lock);
+  vertice->release = release;
+  pthread_mutex_unlock (&vertice->lock);
+  return true;
+}
+
+bool
+tree_set_memo (struct vertice *vertice,
+               uint64_t (*key)(void *data, void *product))
+{
+  /* the tree only drops the memos of vertices memoized when it started */
+  if (!vertice || vertice->tree)
+    return false;
+  pthread_mutex_lock (&vertice->lock);
+  vertice->key = key;
+  pthread_mutex_unlock (&vertice->lock);
+  return true;
+}
+
+/*
+ * Invalidate the memo of VERTICE. Returns the state holding the memoized
+ * product, if any, for the caller to unref once it holds no locks (the
+ * product may be released).
+ */
+static struct tree_state *
+tree_forget (struct vertice *vertice)
+{
+  struct tree_state *holder;
+
+  pthread_mutex_lock (&vertice->lock);
+  holder = vertice->memo_holder;
+  vertice->memo_holder = NULL;
+  vertice->memo_product = NULL;
+  vertice->memo_valid = false;
+  vertice->generation++;
+  pthread_mutex_unlock (&vertice->lock);
+
+  return holder;
+}
+
+/*
+ * Invalidate the memos of VERTICE and everything below it which has not been
+ * visited since invalidation MARK started, adding their holders to HOLDERS.
+ */
+static void
+tree_invalidate_from (struct vertice *vertice, uint64_t mark,
+                      struct tree_state **holders, size_t *num_holders)
+{
+  size_t i;
+
+  if (vertice->invalidated == mark)
+    return;
+  vertice->invalidated = mark;
+
+  if (NULL != (holders[*num_holders] = tree_forget (vertice)))
+    (*num_holders)++;
+  for (i = 0; i < vertice->num_children; i++)
+    tree_invalidate_from (vertice->child[i], mark, holders, num_holders);
+}
+
+bool
+tree_invalidate (struct vertice *vertice)
+{
+  struct tree_state **holders;
+  size_t i, num_holders = 0;
+  struct tree *tree;
+  uint64_t mark;
+
+  if (!vertice)
+    return false;
+
+  /* nothing is memoized before the tree is executed */
+  tree = vertice->tree;
+  if (!tree)
+    return true;
+
+  /* every vertice holds at most one memoized product */
+  holders = malloc (tree->num_vertices * sizeof *holders);
+  if (!holders)
+    return false;
+
+  pthread_mutex_lock (&tree->lock);
+  mark = ++tree->invalidations;
+  tree_invalidate_from (vertice, mark, holders, &num_holders);
+  pthread_mutex_unlock (&tree->lock);
+
+  /* releasing runs the caller's code, which may well use the tree */
+  for (i = 0; i < num_holders; i++)
+    tree_unref (holders[i]);
+  free (holders);
+  return true;
+}
+
 void
 tree_free_vertice (struct vertice *vertice)
 {
   assert (vertice);
   if (NULL != vertice->children)
     async_list_free (vertice->children);
+  free (vertice->child);
+  free (vertice->parents);
   pthread_mutex_destroy (&vertice->lock);
   free (vertice);
 }
@@ -137,8 +536,23 @@ bool
 tree_add_child (struct vertice *parent,
                 struct vertice *child)
 {
+  struct vertice **parents;
+  size_t i;
+
   if (!parent || !child)
     return false;
+
+  /* a join takes one input from each of its parents, so each parent may only
+   * be linked to it once */
+  pthread_mutex_lock (&child->lock);
+  for (i = 0; child->join && i < child->num_parents; i++)
+    if (child->parents[i] == parent)
+      {
+        pthread_mutex_unlock (&child->lock);
+        return false;
+      }
+  pthread_mutex_unlock (&child->lock);
+
   pthread_mutex_lock (&parent->lock);
   if (!parent->children)
     parent->children = async_list_new ();
@@ -146,87 +560,677 @@ tree_add_child (struct vertice *parent,
     return false;
   async_list_add (parent->children, child);
   pthread_mutex_unlock (&parent->lock);
+
+  pthread_mutex_lock (&child->lock);
+  parents = realloc (child->parents,
+                     (child->num_parents + 1) * sizeof *parents);
+  if (!parents)
+    {
+      pthread_mutex_unlock (&child->lock);
+      return false;
+    }
+  parents[child->num_parents++] = parent;
+  child->parents = parents;
+  pthread_mutex_unlock (&child->lock);
   return true;
 }
 
 static void
-tree_loop (void *data)
+tree_loop (void *data);
+
+static struct tree_state *
+tree_state_new (struct tree *tree, struct vertice *vertice,
+                struct tree_line *line, void *product)
+{
+  struct tree_state *state = calloc (1, sizeof *state);
+
+  if (!state)
+    return NULL;
+
+  state->work.func = tree_loop;
+  state->work.data = state;
+  state->tree = tree;
+  state->vertice = vertice;
+  state->line = line;
+  state->product = product;
+  if (tree->profile)
+    state->queued_at = tree_clock ();
+  return state;
+}
+
+/*
+ * Whether A should run before B under TREE_SCHEDULE_DEPTH_FIRST: states of
+ * older iterations go first, and within an iteration the deeper ones. The
+ * root (which starts a new iteration) goes last.
+ */
+static bool
+tree_before (struct tree *tree, struct tree_state *a, struct tree_state *b)
+{
+  uint64_t a_seq = a->vertice == tree->root ? UINT64_MAX : a->line->seq;
+  uint64_t b_seq = b->vertice == tree->root ? UINT64_MAX : b->line->seq;
+
+  if (a_seq != b_seq)
+    return a_seq < b_seq;
+  return a->depth > b->depth;
+}
+
+/*
+ * Take the first ready state off the heap and run it, see TREE_QUEUE. The
+ * token DATA goes back on the tree's list.
+ */
+static void
+tree_dispatch (void *data)
+{
+  struct tree_token *token = data;
+  struct tree *tree = token->tree;
+  struct tree_state *state, *last;
+  size_t i = 0, child;
+
+  pthread_mutex_lock (&tree->ready_lock);
+  token->next = tree->tokens;
+  tree->tokens = token;
+
+  assert (0 < tree->num_ready);
+  state = tree->ready[0];
+  last = tree->ready[--tree->num_ready];
+
+  /* sift the last state down from the top */
+  while ((child = 2 * i + 1) < tree->num_ready)
+    {
+      if (child + 1 < tree->num_ready
+          && tree_before (tree, tree->ready[child + 1], tree->ready[child]))
+        child++;
+      if (!tree_before (tree, tree->ready[child], last))
+        break;
+      tree->ready[i] = tree->ready[child];
+      i = child;
+    }
+  tree->ready[i] = last;
+  pthread_mutex_unlock (&tree->ready_lock);
+
+  tree_loop (state);
+}
+
+/*
+ * Queue STATE to run. By default it goes straight to the pool's queue; with
+ * TREE_SCHEDULE_DEPTH_FIRST it goes on the ready heap and the pool gets a
+ * token for TREE_DISPATCH. Returns false, leaving STATE to the caller, if
+ * there was no memory to queue it with.
+ */
+static bool
+tree_queue (struct tree *tree, struct tree_state *state)
+{
+  struct tree_token *token;
+  size_t i;
+
+  if (TREE_SCHEDULE_DEPTH_FIRST != tree->schedule)
+    return thread_pool_push_work (tree->pool, &state->work);
+
+  /* make room for the state, and find a token, before it is committed */
+  pthread_mutex_lock (&tree->ready_lock);
+  if (tree->num_ready == tree->max_ready)
+    {
+      size_t max_ready = tree->max_ready ? 2 * tree->max_ready : 64;
+      struct tree_state **ready;
+
+      ready = realloc (tree->ready, max_ready * sizeof *ready);
+      if (!ready)
+        {
+          pthread_mutex_unlock (&tree->ready_lock);
+          return false;
+        }
+      tree->ready = ready;
+      tree->max_ready = max_ready;
+    }
+
+  token = tree->tokens;
+  if (token)
+    tree->tokens = token->next;
+  else if (NULL != (token = malloc (sizeof *token)))
+    {
+      token->work.func = tree_dispatch;
+      token->work.data = token;
+      token->tree = tree;
+    }
+  else
+    {
+      pthread_mutex_unlock (&tree->ready_lock);
+      return false;
+    }
+
+  /* sift STATE up from the bottom */
+  for (i = tree->num_ready++; 0 < i; i = (i - 1) / 2)
+    {
+      if (!tree_before (tree, state, tree->ready[(i - 1) / 2]))
+        break;
+      tree->ready[i] = tree->ready[(i - 1) / 2];
+    }
+  tree->ready[i] = state;
+  pthread_mutex_unlock (&tree->ready_lock);
+
+  /* the state is on the heap now, so if the pool cannot take the token this
+   * thread has to run it */
+  if (!thread_pool_push_work (tree->pool, &token->work))
+    tree_dispatch (token);
+  return true;
+}
+
+/*
+ * Schedule STATE to run, on this thread if it cannot be queued: a state that
+ * is dropped would keep its iteration from ever finishing.
+ */
+static void
+tree_push (struct tree *tree, struct tree_state *state)
+{
+  if (!tree_queue (tree, state))
+    tree_loop (state);
+}
+
+/*
+ * Start a new root iteration, with room for the inputs of every join.
+ */
+static struct tree_line *
+tree_line_new (struct tree *tree)
+{
+  struct tree_line *line;
+  void **inputs;
+  size_t i;
+
+  struct tree_state **from;
+  uint64_t *path;
+
+  line = malloc (sizeof *line + tree->num_joins * sizeof *line->join
+                 + tree->num_join_inputs * (sizeof *path + sizeof *inputs
+                                            + sizeof *from));
+  if (!line)
+    return NULL;
+
+  line->pending = 1;
+  line->span = 0;
+  path = (uint64_t *) &line->join[tree->num_joins];
+  inputs = (void **) &path[tree->num_join_inputs];
+  from = (struct tree_state **) &inputs[tree->num_join_inputs];
+  for (i = 0; i < tree->num_joins; i++)
+    {
+      line->join[i].pending = tree->joins[i]->num_parents;
+      line->join[i].inputs = inputs;
+      line->join[i].from = from;
+      line->join[i].path = path;
+      memset (from, 0, tree->joins[i]->num_parents * sizeof *from);
+      inputs += tree->joins[i]->num_parents;
+      from += tree->joins[i]->num_parents;
+      path += tree->joins[i]->num_parents;
+    }
+  return line;
+}
+
+/*
+ * Hand PRODUCT from PARENT to the join vertice JOIN in LINE. Returns the state
+ * to run JOIN with once the last of its parents has delivered, otherwise NULL.
+ */
+static struct tree_state *
+tree_deliver (struct tree *tree, struct tree_line *line,
+              struct vertice *parent, struct vertice *join, void *product,
+              struct tree_state *holder, uint64_t path)
+{
+  struct tree_join *inputs = &line->join[join->join_index];
+  struct tree_state *state;
+  size_t slot;
+
+  for (slot = 0; join->parents[slot] != parent; slot++)
+    continue;
+  inputs->inputs[slot] = product;
+  inputs->from[slot] = holder;
+  inputs->path[slot] = path;
+
+  /* the barrier also publishes the other parents' inputs to this thread */
+  if (0 != __sync_sub_and_fetch (&inputs->pending, 1))
+    return NULL;
+
+  /* without the memory to run the join it is skipped, and is done with its
+   * inputs at once */
+  state = tree_state_new (tree, join, line, inputs->inputs);
+  if (NULL == state)
+    {
+      for (slot = 0; slot < join->num_parents; slot++)
+        tree_unref (inputs->from[slot]);
+      return NULL;
+    }
+  __sync_fetch_and_add (&line->pending, 1);
+
+  /* the join is reached through whichever parent finished its path last */
+  if (tree->profile)
+    for (slot = 0; slot < join->num_parents; slot++)
+      if (!state->crit_from || state->path < inputs->path[slot])
+        {
+          state->path = inputs->path[slot];
+          state->crit_from = join->parents[slot];
+        }
+  return state;
+}
+
+/*
+ * Record a run of the vertice of STATE, in LINE, which began at START.
+ * Returns the length of the longest path of runs in the iteration which ends
+ * with this one.
+ */
+static uint64_t
+tree_profile (struct tree *tree, struct tree_state *state,
+              struct tree_line *line, uint64_t start)
+{
+  struct vertice *vertice = state->vertice;
+  uint64_t end = tree_clock ();
+  uint64_t path = state->path + (end - start);
+  uint64_t span;
+
+  __sync_fetch_and_add (&vertice->stats.runs, 1);
+  __sync_fetch_and_add (&vertice->stats.busy_nsec, end - start);
+  __sync_fetch_and_add (&vertice->stats.wait_nsec, start - state->queued_at);
+  __sync_fetch_and_add (&tree->work_nsec, end - start);
+
+  if (vertice->stats.path_nsec < path)
+    {
+      pthread_mutex_lock (&vertice->lock);
+      if (vertice->stats.path_nsec < path)
+        {
+          vertice->stats.path_nsec = path;
+          vertice->critical_parent = state->crit_from;
+        }
+      pthread_mutex_unlock (&vertice->lock);
+    }
+
+  do
+    span = line->span;
+  while (span < path
+         && !__sync_bool_compare_and_swap (&line->span, span, path));
+
+  return path;
+}
+
+/*
+ * Drop a reference to the product HOLDER holds (if any), releasing it once
+ * no child uses it any more.
+ */
+static void
+tree_unref (struct tree_state *holder)
+{
+  if (NULL == holder || 0 != __sync_sub_and_fetch (&holder->refs, 1))
+    return;
+
+  holder->vertice->release (holder->vertice->data, holder->product);
+  free (holder);
+}
+
+/*
+ * Finish one tree_state of LINE. Once the whole iteration has finished the
+ * root is resumed if it was parked, and the pool is shut down if the root
+ * will not run again.
+ */
+static void
+tree_finish (struct tree *tree, struct tree_line *line)
+{
+  struct tree_state *resume = NULL;
+  size_t i, slot;
+  bool done;
+
+  if (0 != __sync_sub_and_fetch (&line->pending, 1))
+    return;
+
+  /* a join never runs if one of its parents was skipped for want of
+   * memory, and is still holding the inputs the others delivered */
+  for (i = 0; i < tree->num_joins; i++)
+    if (0 != line->join[i].pending)
+      for (slot = 0; slot < tree->joins[i]->num_parents; slot++)
+        tree_unref (line->join[i].from[slot]);
+
+  pthread_mutex_lock (&tree->lock);
+
+  if (tree->profile)
+    {
+      tree->iterations++;
+      tree->span_nsec += line->span;
+      if (tree->max_span_nsec < line->span)
+        tree->max_span_nsec = line->span;
+    }
+  free (line);
+
+  tree->active_lines--;
+  if (tree->parked && tree->active_lines < tree->max_inflight)
+    {
+      resume = tree->parked;
+      tree->parked = NULL;
+    }
+  done = tree->root_done && 0 == tree->active_lines;
+
+  pthread_mutex_unlock (&tree->lock);
+
+  if (resume)
+    tree_push (tree, resume);
+  if (done)
+    thread_pool_terminate (tree->pool);
+}
+
+/*
+ * Run the vertice of STATE and hand its product to the children. All but one
+ * of the children are pushed to the pool; the last one to become ready is
+ * returned for this thread to carry on with, so a chain of single children
+ * runs without any scheduling and the product stays in this thread's cache.
+ * Where possible the state is reused for that child too.
+ */
+static struct tree_state *
+tree_run (struct tree_state *state)
 {
-  struct tree_state *state = data;
   struct tree *tree = state->tree;
   struct vertice *vertice = state->vertice;
+  struct tree_line *line = state->line;
   void *product = state->product;
+  struct tree_state *from = state->from;
+  struct tree_state *holder = NULL;
+  struct tree_state *next = NULL;
+  bool reused = false;
   void *new_product = NULL;
+  bool memoized = false;
+  uint64_t key = 0;
+  uint64_t generation = 0;
+  uint64_t start = 0;
+  uint64_t path = 0;
 
   assert (tree);
   assert (vertice);
 
   if (vertice == tree->root)
     {
+      uint64_t seq;
+      bool done;
+
       pthread_mutex_lock (&tree->lock);
       if (tree->terminated)
         {
+          tree->root_done = true;
+          done = 0 == tree->active_lines;
           pthread_mutex_unlock (&tree->lock);
           free (state);
-          return;
+          if (done)
+            thread_pool_terminate (tree->pool);
+          return NULL;
         }
 
-      /* poor mans cond_wait */
-      if (tree->max_threads < tree->active_lines)
+      /* too many iterations in flight: park the root until one finishes */
+      if (tree->max_inflight <= tree->active_lines)
         {
+          tree->parked = state;
           pthread_mutex_unlock (&tree->lock);
-          thread_pool_push (tree->pool, tree_loop, state);
-          return;
+          return NULL;
         }
 
+      /* a root without children only runs once */
+      if (0 == vertice->num_children)
+        tree->root_done = true;
+
       tree->active_lines++;
+      seq = tree->next_line++;
       pthread_mutex_unlock (&tree->lock);
+
+      line = tree_line_new (tree);
+      assert (line);
+      line->seq = seq;
+    }
+
+  /* execute this vertice; a join is handed the inputs from all its parents */
+  if (tree->profile)
+    start = tree_clock ();
+
+  /* a memoized vertice whose input has the same key as last time hands on
+   * the same product again, and the memo's reference to it if it has one */
+  if (vertice->key)
+    {
+      key = vertice->key (vertice->data, product);
+
+      pthread_mutex_lock (&vertice->lock);
+      generation = vertice->generation;
+      if (vertice->memo_valid && vertice->memo_key == key)
+        {
+          memoized = true;
+          new_product = vertice->memo_product;
+          holder = vertice->memo_holder;
+          if (holder)
+            __sync_fetch_and_add (&holder->refs, 1);
+        }
+      pthread_mutex_unlock (&vertice->lock);
     }
 
-  /* execute this vertice */
-  new_product = vertice->routine (vertice->data, product);
+  if (memoized)
+    ;
+  else if (vertice->join)
+    new_product = vertice->join (vertice->data, product,
+                                 vertice->num_parents);
+  else
+    new_product = vertice->routine (vertice->data, product);
+
+  if (tree->profile)
+    path = tree_profile (tree, state, line, start);
+
+  /* a product to be released is held by a state until every child is done
+   * with it (and the memo has dropped it); the root's state is needed to
+   * restart it so it gets a new one */
+  if (!memoized && vertice->release && NULL != new_product)
+    {
+      if (0 == vertice->num_children && !vertice->key)
+        vertice->release (vertice->data, new_product);
+      else if (vertice == tree->root)
+        {
+          holder = tree_state_new (tree, vertice, line, new_product);
+          assert (holder);
+        }
+      else
+        {
+          holder = state;
+          holder->product = new_product;
+        }
+
+      if (holder)
+        holder->refs = 1;
+    }
+
+  /* remember the result, unless the vertice was invalidated while it ran */
+  if (!memoized && vertice->key)
+    {
+      struct tree_state *old = NULL;
+
+      pthread_mutex_lock (&vertice->lock);
+      if (vertice->generation == generation)
+        {
+          old = vertice->memo_holder;
+          vertice->memo_valid = true;
+          vertice->memo_key = key;
+          vertice->memo_product = new_product;
+          vertice->memo_holder = holder;
+          if (holder)
+            __sync_fetch_and_add (&holder->refs, 1);
+        }
+      pthread_mutex_unlock (&vertice->lock);
+
+      tree_unref (old);
+    }
 
   /* non-terminal verticies may return NULL and that NULL pointer will still be
    * passed to any children */
-  if (NULL != vertice->children)
+  if (0 != vertice->num_children)
     {
-      uint64_t i;
-      for (i = 0; i < async_list_count (vertice->children); i++)
+      size_t i, count = vertice->num_children;
+
+      for (i = 0; i < count; i++)
         {
-          struct tree_state *new_state = calloc (1, sizeof *new_state);
-          new_state->tree = tree;
-          new_state->vertice = async_list_get (vertice->children, i);
-          new_state->product = new_product;
-          thread_pool_push (tree->pool, tree_loop, new_state);
+          struct vertice *child = vertice->child[i];
+          struct tree_state *new_state;
+
+          if (holder)
+            __sync_fetch_and_add (&holder->refs, 1);
+
+          if (child->join)
+            new_state = tree_deliver (tree, line, vertice, child, new_product,
+                                      holder, path);
+          else
+            {
+              /* the last child may take over this state, unless it is
+               * still needed to hold the product or restart the root */
+              if (i + 1 == count && state != holder && vertice != tree->root)
+                {
+                  new_state = state;
+                  new_state->vertice = child;
+                  new_state->product = new_product;
+                  if (tree->profile)
+                    new_state->queued_at = tree_clock ();
+                  reused = true;
+                }
+              else
+                new_state = tree_state_new (tree, child, line, new_product);
+
+              /* without the memory to run the child it is skipped */
+              if (NULL == new_state)
+                {
+                  tree_unref (holder);
+                  continue;
+                }
+              __sync_fetch_and_add (&line->pending, 1);
+              new_state->from = holder;
+              new_state->path = path;
+              new_state->crit_from = vertice;
+            }
+
+          if (NULL == new_state)
+            continue;
+          new_state->depth = state->depth + 1;
+
+          /* hold back the latest child to carry on with, pushing the one
+           * held back before */
+          if (next)
+            tree_push (tree, next);
+          next = new_state;
         }
+    }
 
-      /* restart root vertice */
-      if (vertice == tree->root)
-        thread_pool_push (tree->pool, tree_loop, state);
-      else
-        free (state);
-      return;
+  /* this vertice is done with its inputs */
+  if (vertice->join)
+    {
+      struct tree_join *inputs = &line->join[vertice->join_index];
+      size_t i;
+
+      for (i = 0; i < vertice->num_parents; i++)
+        tree_unref (inputs->from[i]);
     }
+  else
+    tree_unref (from);
 
-  /* here the vertice is surely terminal, hence NEW_PRODUCT should be NULL */
-  free (state);
-  pthread_mutex_lock (&tree->lock);
-  if (0 == --tree->active_lines)
-    thread_pool_terminate (tree->pool);
-  pthread_mutex_unlock (&tree->lock);
+  /* restart root vertice */
+  if (vertice == tree->root && 0 != vertice->num_children)
+    {
+      if (tree->profile)
+        state->queued_at = tree_clock ();
+      tree_push (tree, state);
+    }
+  else if (state != holder && !reused)
+    free (state);
+
+  tree_unref (holder);
+
+  tree_finish (tree, line);
+  return next;
+}
+
+static void
+tree_loop (void *data)
+{
+  struct tree_state *state = data;
+
+  while (NULL != state)
+    state = tree_run (state);
+}
+
+/*
+ * Visit every vertice reachable from VERTICE, numbering the joins and
+ * freezing the children of each into an array.
+ */
+static bool
+tree_index (struct tree *tree, struct vertice *vertice)
+{
+  struct vertice **vertices;
+  size_t i;
+
+  if (vertice->tree == tree)
+    return true;
+  vertice->tree = tree;
+
+  vertices = realloc (tree->vertices,
+                      (tree->num_vertices + 1) * sizeof *vertices);
+  if (!vertices)
+    return false;
+  tree->vertices = vertices;
+  tree->vertices[tree->num_vertices++] = vertice;
+
+  free (vertice->child);
+  vertice->child = NULL;
+  vertice->num_children = 0;
+  if (NULL != vertice->children)
+    {
+      size_t count = async_list_count (vertice->children);
+
+      vertice->child = malloc (count * sizeof *vertice->child);
+      if (!vertice->child)
+        return false;
+      for (i = 0; i < count; i++)
+        vertice->child[i] = async_list_get (vertice->children, i);
+      vertice->num_children = count;
+    }
+
+  if (vertice->join)
+    {
+      struct vertice **joins;
+
+      joins = realloc (tree->joins, (tree->num_joins + 1) * sizeof *joins);
+      if (!joins)
+        return false;
+      tree->joins = joins;
+
+      vertice->join_index = tree->num_joins;
+      tree->joins[tree->num_joins++] = vertice;
+      tree->num_join_inputs += vertice->num_parents;
+    }
+
+  if (vertice->key)
+    {
+      struct vertice **memos;
+
+      memos = realloc (tree->memos, (tree->num_memos + 1) * sizeof *memos);
+      if (!memos)
+        return false;
+      tree->memos = memos;
+      tree->memos[tree->num_memos++] = vertice;
+    }
+
+  for (i = 0; i < vertice->num_children; i++)
+    if (!tree_index (tree, vertice->child[i]))
+      return false;
+  return true;
 }
 
 bool
 tree_execute (struct tree *tree)
 {
-  struct tree_state *state = calloc (1, sizeof *state);
+  struct tree_state *state;
 
-  if (!state || !tree || !tree->root || !tree->pool)
+  if (!tree || !tree->root || !tree->pool)
     return false;
 
-  state->tree = tree;
-  state->vertice = tree->root;
-  state->product = NULL;
+  if (tree->root->join || !tree_index (tree, tree->root))
+    return false;
 
-  return thread_pool_push (tree->pool, tree_loop, state);
+  state = tree_state_new (tree, tree->root, NULL, NULL);
+  if (!state)
+    return false;
+
+  if (tree_queue (tree, state))
+    return true;
+  free (state);
+  return false;
 }